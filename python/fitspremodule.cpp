@@ -0,0 +1,781 @@
+/*
+ * @file fitspremodule.cpp Python扩展模块: 内存中调用FitsHandler和ADIProcess
+ * @version 0.1
+ * @author Xiaomeng Lu
+ * @note
+ * - 数组经缓冲区协议传入和传出, 须为C连续的float32(掩码为uint8).
+ *   直接读写数组内存, 不复制. 可直接使用NumPy数组, 编译时不依赖NumPy
+ * - 执行C++核期间释放GIL. 同一对象的调用以互斥锁串行执行
+ * @note
+ * 接口:
+ * - FitsFile(path)             : 打开FITS文件. 属性shape=(rows, cols), exptime
+ *   - read(out, row=0, col=0)  : 从(row, col)起连续读取len(out)个像素
+ *   - read_image(out)          : 读取整幅图像
+ *   - read_extension(name, out): 读取图像扩展
+ * - Processor()
+ *   - combine(type, stack, out, var=None, ncomb=None, scales=None)
+ *   - set_master(type, data, var=None)/load_master(type, path)
+ *   - calibrate(data, exptime, weight=None) : 就地定标, 返回修复的宇宙线像素数
+ *   - background(data)         : 返回(back, rms)
+ *   - detect(data)             : 返回(back, rms, [(x, y, flux, peak, area), ...])
+ *   - detect_cosmic(data, exptime, mask) : 返回宇宙线像素数
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include <new>
+#include <exception>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include "FitsHandler.h"
+#include "ADIProcess.h"
+
+using namespace AstroUtil;
+
+//////////////////////////////////////////////////////////////////////////////
+/*
+ * 作用域内释放GIL
+ */
+class NoGIL {
+public:
+	NoGIL() {
+		state_ = PyEval_SaveThread();
+	}
+
+	~NoGIL() {
+		PyEval_RestoreThread(state_);
+	}
+
+protected:
+	PyThreadState *state_;
+};
+
+/*
+ * 将处理中的C++异常转换为Python异常. 仅在catch块中调用
+ * - std::bad_alloc: MemoryError
+ * - 其它: RuntimeError
+ */
+static PyObject *raise_cpp_error() {
+	try {
+		throw;
+	}
+	catch(std::bad_alloc &) {
+		PyErr_NoMemory();
+	}
+	catch(std::exception &e) {
+		PyErr_SetString(PyExc_RuntimeError, e.what());
+	}
+	catch(...) {
+		PyErr_SetString(PyExc_RuntimeError, "unknown C++ exception");
+	}
+	return NULL;
+}
+
+/*
+ * 缓冲区协议访问的数组. 析构时释放
+ */
+class BufferView {
+public:
+	BufferView() {
+		valid_ = false;
+	}
+
+	~BufferView() {
+		if (valid_)
+			PyBuffer_Release(&view_);
+	}
+
+protected:
+	Py_buffer view_;
+	bool valid_;
+
+public:
+	/*!
+	 * @brief 获取C连续数组
+	 * @param obj      支持缓冲区协议的对象
+	 * @param name     参数名. 用于错误提示
+	 * @param fmt      元素类型. 'f': float32; 'B': uint8
+	 * @param writable 是否需要写入
+	 * @param ndim     维数. 0: 不检查
+	 * @return
+	 * 获取结果. 失败时已设置Python异常
+	 */
+	bool Get(PyObject *obj, const char *name, char fmt, bool writable,
+			int ndim) {
+		int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT
+				| (writable ? PyBUF_WRITABLE : 0);
+		const char *f;
+		char c;
+
+		if (PyObject_GetBuffer(obj, &view_, flags))
+			return false;
+		valid_ = true;
+		// 仅接受本机字节序. 掩码可为有符号字节或bool
+		f = view_.format ? view_.format : "B";
+		if (*f == '@' || *f == '=' || *f == '<')
+			++f;
+		if ((c = *f) && fmt == 'B' && (c == 'b' || c == '?'))
+			c = 'B';
+		if (c != fmt || f[1] || view_.itemsize != (fmt == 'f' ? 4 : 1)) {
+			PyErr_Format(PyExc_TypeError, "%s: expected %s array", name,
+					fmt == 'f' ? "float32" : "uint8");
+			return false;
+		}
+		if (ndim && view_.ndim != ndim) {
+			PyErr_Format(PyExc_ValueError, "%s: expected %d-d array", name,
+					ndim);
+			return false;
+		}
+		return true;
+	}
+
+	void *Data() {
+		return view_.buf;
+	}
+
+	float *Float() {
+		return (float*) view_.buf;
+	}
+
+	Py_ssize_t Size() {
+		return view_.itemsize ? view_.len / view_.itemsize : 0;
+	}
+
+	Py_ssize_t Shape(int i) {
+		return view_.shape[i];
+	}
+	/*!
+	 * @brief 检查二维数组尺寸
+	 */
+	bool Check(const char *name, int cols, int rows) {
+		if (Shape(0) != rows || Shape(1) != cols) {
+			PyErr_Format(PyExc_ValueError, "%s: expected shape (%d, %d)", name,
+					rows, cols);
+			return false;
+		}
+		return true;
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////////
+/* FitsFile */
+struct PyFitsFile {
+	PyObject_HEAD
+	FitsHandler *fh;		//< 文件
+	boost::mutex *mtx;		//< 串行访问
+	int cols, rows;			//< 图像尺寸
+};
+
+static void fits_dealloc(PyFitsFile *self) {
+	PyTypeObject *tp = Py_TYPE(self);
+	delete self->fh;
+	delete self->mtx;
+	tp->tp_free((PyObject*) self);
+	Py_DECREF(tp);
+}
+
+static int fits_init(PyFitsFile *self, PyObject *args, PyObject *kwds) {
+	static const char *kwlist[] = { "path", NULL };
+	const char *path;
+	bool rslt;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", (char**) kwlist, &path))
+		return -1;
+	delete self->fh;
+	self->fh = NULL;
+	try {
+		if (!self->mtx)
+			self->mtx = new boost::mutex;
+		self->fh = new FitsHandler;
+		NoGIL nogil;
+		if ((rslt = self->fh->Open(path)))
+			self->fh->GetDimension(self->cols, self->rows);
+	}
+	catch(...) {
+		raise_cpp_error();
+		return -1;
+	}
+	if (!rslt) {
+		PyErr_Format(PyExc_OSError, "failed to open %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static bool fits_check(PyFitsFile *self) {
+	if (!self->fh || !(*self->fh)()) {
+		PyErr_SetString(PyExc_ValueError, "file is not open");
+		return false;
+	}
+	return true;
+}
+
+static PyObject *fits_shape(PyFitsFile *self, void *) {
+	if (!fits_check(self))
+		return NULL;
+	return Py_BuildValue("(ii)", self->rows, self->cols);
+}
+
+static PyObject *fits_exptime(PyFitsFile *self, void *) {
+	float exptime;
+
+	if (!fits_check(self))
+		return NULL;
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		exptime = self->fh->GetExptime();
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	return PyFloat_FromDouble(exptime);
+}
+
+static PyObject *fits_read(PyFitsFile *self, PyObject *args, PyObject *kwds) {
+	static const char *kwlist[] = { "out", "row", "col", NULL };
+	PyObject *obj;
+	BufferView out;
+	int row(0), col(0);
+	Py_ssize_t n;
+	bool rslt;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ii", (char**) kwlist,
+			&obj, &row, &col) || !fits_check(self)
+			|| !out.Get(obj, "out", 'f', true, 0))
+		return NULL;
+	n = out.Size();
+	if (row < 0 || col < 0 || col >= self->cols || n < 1 || Py_ssize_t(row)
+			* self->cols + col + n > Py_ssize_t(self->rows) * self->cols) {
+		PyErr_SetString(PyExc_ValueError, "read exceeds image");
+		return NULL;
+	}
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		rslt = self->fh->LoadPixels(out.Float(), int(n), row, col);
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	if (!rslt)
+		return PyErr_Format(PyExc_OSError, "failed to read pixels");
+	Py_RETURN_NONE;
+}
+
+static PyObject *fits_read_image(PyFitsFile *self, PyObject *args) {
+	PyObject *obj;
+	BufferView out;
+	bool rslt;
+
+	if (!PyArg_ParseTuple(args, "O", &obj) || !fits_check(self)
+			|| !out.Get(obj, "out", 'f', true, 2)
+			|| !out.Check("out", self->cols, self->rows))
+		return NULL;
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		rslt = self->fh->LoadImage(out.Float());
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	if (!rslt)
+		return PyErr_Format(PyExc_OSError, "failed to read image");
+	Py_RETURN_NONE;
+}
+
+static PyObject *fits_read_extension(PyFitsFile *self, PyObject *args) {
+	const char *extname;
+	PyObject *obj;
+	BufferView out;
+	bool rslt;
+
+	if (!PyArg_ParseTuple(args, "sO", &extname, &obj) || !fits_check(self)
+			|| !out.Get(obj, "out", 'f', true, 2)
+			|| !out.Check("out", self->cols, self->rows))
+		return NULL;
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		rslt = self->fh->LoadExtension(extname, out.Float());
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	if (!rslt)
+		return PyErr_Format(PyExc_OSError, "failed to read extension %s",
+				extname);
+	Py_RETURN_NONE;
+}
+
+static PyObject *fits_close(PyFitsFile *self, PyObject *) {
+	if (self->fh) {
+		try {
+			NoGIL nogil;
+			boost::mutex::scoped_lock lck(*self->mtx);
+			self->fh->Close();
+		}
+		catch(...) {
+			return raise_cpp_error();
+		}
+	}
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef fits_methods[] = {
+	{ "read", (PyCFunction) fits_read, METH_VARARGS | METH_KEYWORDS,
+		"read(out, row=0, col=0): read len(out) pixels starting at (row, col)" },
+	{ "read_image", (PyCFunction) fits_read_image, METH_VARARGS,
+		"read_image(out): read the whole image into a (rows, cols) array" },
+	{ "read_extension", (PyCFunction) fits_read_extension, METH_VARARGS,
+		"read_extension(extname, out): read an image extension" },
+	{ "close", (PyCFunction) fits_close, METH_NOARGS, "close the file" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef fits_getset[] = {
+	{ (char*) "shape", (getter) fits_shape, NULL, (char*) "(rows, cols)", NULL },
+	{ (char*) "exptime", (getter) fits_exptime, NULL, (char*) "EXPTIME", NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyType_Slot fits_slots[] = {
+	{ Py_tp_dealloc, (void*) fits_dealloc },
+	{ Py_tp_init, (void*) fits_init },
+	{ Py_tp_new, (void*) PyType_GenericNew },
+	{ Py_tp_methods, (void*) fits_methods },
+	{ Py_tp_getset, (void*) fits_getset },
+	{ Py_tp_doc, (void*) "FitsFile(path): FITS image opened for block reads" },
+	{ 0, NULL }
+};
+
+static PyType_Spec fits_spec = {
+	"fitspre.FitsFile", sizeof(PyFitsFile), 0, Py_TPFLAGS_DEFAULT, fits_slots
+};
+
+//////////////////////////////////////////////////////////////////////////////
+/* Processor */
+struct PyProcessor {
+	PyObject_HEAD
+	ADIProcess *proc;		//< 处理接口
+	boost::mutex *mtx;		//< 串行访问
+	param_cosmic cosmic;	//< 宇宙线识别参数
+	param_dip dip;			//< 信号提取参数
+	param_detector detector;	//< 探测器噪声参数
+};
+
+static void proc_dealloc(PyProcessor *self) {
+	PyTypeObject *tp = Py_TYPE(self);
+	delete self->proc;
+	delete self->mtx;
+	tp->tp_free((PyObject*) self);
+	Py_DECREF(tp);
+}
+
+static int proc_init(PyProcessor *self, PyObject *args, PyObject *kwds) {
+	static const char *kwlist[] = { NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", (char**) kwlist))
+		return -1;
+	delete self->proc;
+	self->proc = NULL;
+	try {
+		if (!self->mtx)
+			self->mtx = new boost::mutex;
+		self->proc = new ADIProcess;
+	}
+	catch(...) {
+		raise_cpp_error();
+		return -1;
+	}
+	new (&self->cosmic) param_cosmic;
+	new (&self->dip) param_dip;
+	new (&self->detector) param_detector;
+	return 0;
+}
+
+static bool proc_check(PyProcessor *self) {
+	if (!self->proc) {
+		PyErr_SetString(PyExc_ValueError, "processor is not initialized");
+		return false;
+	}
+	return true;
+}
+
+static bool check_type(int type) {
+	if (type < IMGTYP_ZERO || type > IMGTYP_FLAT) {
+		PyErr_SetString(PyExc_ValueError, "type must be ZERO, DARK or FLAT");
+		return false;
+	}
+	return true;
+}
+
+static PyObject *proc_set_detector(PyProcessor *self, PyObject *args,
+		PyObject *kwds) {
+	static const char *kwlist[] = { "gain", "readnoise", NULL };
+	param_detector &param = self->detector;
+
+	if (!proc_check(self) || !PyArg_ParseTupleAndKeywords(args, kwds, "|ff",
+			(char**) kwlist, &param.gain, &param.readnoise))
+		return NULL;
+	self->proc->SetDetector(param);
+	Py_RETURN_NONE;
+}
+
+static PyObject *proc_set_cosmic(PyProcessor *self, PyObject *args,
+		PyObject *kwds) {
+	static const char *kwlist[] = { "enable", "sigclip", "sigfrac", "objlim",
+		"tile", NULL };
+	param_cosmic &param = self->cosmic;
+	int enable(1);
+
+	if (!proc_check(self) || !PyArg_ParseTupleAndKeywords(args, kwds,
+			"|pfffi", (char**) kwlist, &enable, &param.sigclip, &param.sigfrac,
+			&param.objlim, &param.tile))
+		return NULL;
+	param.enable = enable != 0;
+	self->proc->SetCosmic(param);
+	Py_RETURN_NONE;
+}
+
+static PyObject *proc_set_process(PyProcessor *self, PyObject *args,
+		PyObject *kwds) {
+	static const char *kwlist[] = { "snr", "minarea", NULL };
+	param_dip &param = self->dip;
+
+	if (!proc_check(self) || !PyArg_ParseTupleAndKeywords(args, kwds, "|fi",
+			(char**) kwlist, &param.snr, &param.minarea))
+		return NULL;
+	self->proc->SetProcess(param);
+	Py_RETURN_NONE;
+}
+
+static PyObject *proc_combine(PyProcessor *self, PyObject *args,
+		PyObject *kwds) {
+	static const char *kwlist[] = { "type", "stack", "out", "var", "ncomb",
+		"scales", NULL };
+	PyObject *ostack, *oout, *ovar(Py_None), *oncomb(Py_None);
+	PyObject *oscales(Py_None), *seq;
+	BufferView stack, out, var, ncomb;
+	std::vector<float> scales;
+	int type, nframe, cols, rows, mcols, mrows;
+	Py_ssize_t i;
+	bool rslt(false), mismatch(false);
+
+	if (!proc_check(self) || !PyArg_ParseTupleAndKeywords(args, kwds,
+			"iOO|OOO", (char**) kwlist, &type, &ostack, &oout, &ovar, &oncomb,
+			&oscales) || !check_type(type)
+			|| !stack.Get(ostack, "stack", 'f', false, 3))
+		return NULL;
+	nframe = int(stack.Shape(0));
+	rows = int(stack.Shape(1));
+	cols = int(stack.Shape(2));
+	if (!out.Get(oout, "out", 'f', true, 2) || !out.Check("out", cols, rows)
+			|| (ovar != Py_None && (!var.Get(ovar, "var", 'f', true, 2)
+				|| !var.Check("var", cols, rows)))
+			|| (oncomb != Py_None && (!ncomb.Get(oncomb, "ncomb", 'f', true, 2)
+				|| !ncomb.Check("ncomb", cols, rows))))
+		return NULL;
+	if (oscales != Py_None) {// 归一化系数个数与帧数相同, 复制
+		if (!(seq = PySequence_Fast(oscales, "scales must be a sequence")))
+			return NULL;
+		for (i = 0; i < PySequence_Fast_GET_SIZE(seq); ++i)
+			scales.push_back(float(PyFloat_AsDouble(
+					PySequence_Fast_GET_ITEM(seq, i))));
+		Py_DECREF(seq);
+		if (PyErr_Occurred())
+			return NULL;
+		if (int(scales.size()) != nframe) {
+			PyErr_SetString(PyExc_ValueError, "scales: one value per frame");
+			return NULL;
+		}
+	}
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		// 不以尺寸不同的帧替换已加载标定图像
+		mismatch = self->proc->MasterDimension(mcols, mrows)
+				&& (mcols != cols || mrows != rows);
+		if (!mismatch)
+			rslt = self->proc->CombineStack(type, stack.Float(), nframe, cols,
+					rows, scales.size() ? &scales[0] : NULL, out.Float(),
+					ovar != Py_None ? var.Float() : NULL,
+					oncomb != Py_None ? ncomb.Float() : NULL);
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	if (mismatch)
+		return PyErr_Format(PyExc_ValueError, "stack frames are (%d, %d), "
+				"loaded masters are (%d, %d)", rows, cols, mrows, mcols);
+	if (!rslt) {
+		PyErr_SetString(PyExc_RuntimeError, "combine failed: needs >= 3 "
+				"frames, exposure times for dark and a matching zero");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *proc_set_master(PyProcessor *self, PyObject *args,
+		PyObject *kwds) {
+	static const char *kwlist[] = { "type", "data", "var", NULL };
+	PyObject *odata, *ovar(Py_None);
+	BufferView data, var;
+	int type, cols, rows;
+	bool rslt;
+
+	if (!proc_check(self) || !PyArg_ParseTupleAndKeywords(args, kwds, "iO|O",
+			(char**) kwlist, &type, &odata, &ovar) || !check_type(type)
+			|| !data.Get(odata, "data", 'f', false, 2))
+		return NULL;
+	rows = int(data.Shape(0));
+	cols = int(data.Shape(1));
+	if (ovar != Py_None && (!var.Get(ovar, "var", 'f', false, 2)
+			|| !var.Check("var", cols, rows)))
+		return NULL;
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		rslt = self->proc->SetMaster(type, data.Float(), cols, rows,
+				ovar != Py_None ? var.Float() : NULL);
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	if (!rslt) {
+		PyErr_SetString(PyExc_ValueError, "shape differs from loaded zero");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *proc_load_master(PyProcessor *self, PyObject *args) {
+	const char *path;
+	int type;
+	bool rslt;
+
+	if (!proc_check(self) || !PyArg_ParseTuple(args, "is", &type, &path)
+			|| !check_type(type))
+		return NULL;
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		rslt = type == IMGTYP_ZERO ? self->proc->SetZero(path)
+				: (type == IMGTYP_DARK ? self->proc->SetDark(path)
+					: self->proc->SetFlat(path));
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	if (!rslt)
+		return PyErr_Format(PyExc_OSError, "failed to load %s", path);
+	Py_RETURN_NONE;
+}
+
+static PyObject *proc_calibrate(PyProcessor *self, PyObject *args,
+		PyObject *kwds) {
+	static const char *kwlist[] = { "data", "exptime", "weight", NULL };
+	PyObject *odata, *oweight(Py_None);
+	BufferView data, weight;
+	float exptime;
+	int cols, rows, ncosmic;
+
+	if (!proc_check(self) || !PyArg_ParseTupleAndKeywords(args, kwds, "Of|O",
+			(char**) kwlist, &odata, &exptime, &oweight)
+			|| !data.Get(odata, "data", 'f', true, 2))
+		return NULL;
+	rows = int(data.Shape(0));
+	cols = int(data.Shape(1));
+	if (oweight != Py_None && (!weight.Get(oweight, "weight", 'f', true, 2)
+			|| !weight.Check("weight", cols, rows)))
+		return NULL;
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		ncosmic = self->proc->CalibrateFrame(data.Float(), cols, rows, exptime,
+				oweight != Py_None ? weight.Float() : NULL);
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	if (ncosmic < 0) {
+		PyErr_SetString(PyExc_ValueError, "shape differs from loaded masters");
+		return NULL;
+	}
+	return PyLong_FromLong(ncosmic);
+}
+
+static PyObject *proc_background(PyProcessor *self, PyObject *args) {
+	PyObject *odata;
+	BufferView data;
+	float back, rms;
+
+	if (!proc_check(self) || !PyArg_ParseTuple(args, "O", &odata)
+			|| !data.Get(odata, "data", 'f', false, 0))
+		return NULL;
+	if (data.Size() > 0x7FFFFFFF) {
+		PyErr_SetString(PyExc_ValueError, "data: too many pixels");
+		return NULL;
+	}
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		self->proc->EstimateBackground(data.Float(), int(data.Size()), back,
+				rms);
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	return Py_BuildValue("(ff)", back, rms);
+}
+
+static PyObject *proc_detect(PyProcessor *self, PyObject *args) {
+	PyObject *odata, *list, *item;
+	BufferView data;
+	ObjectVec objects;
+	float back, rms;
+
+	if (!proc_check(self) || !PyArg_ParseTuple(args, "O", &odata)
+			|| !data.Get(odata, "data", 'f', false, 2))
+		return NULL;
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		self->proc->ExtractObjects(data.Float(), int(data.Shape(1)),
+				int(data.Shape(0)), back, rms, objects);
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	if (!(list = PyList_New(objects.size())))
+		return NULL;
+	for (size_t i = 0; i < objects.size(); ++i) {
+		dip_object &obj = objects[i];
+		if (!(item = Py_BuildValue("(ffffi)", obj.x, obj.y, obj.flux, obj.peak,
+				obj.area))) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+	return Py_BuildValue("(ffN)", back, rms, list);
+}
+
+static PyObject *proc_detect_cosmic(PyProcessor *self, PyObject *args,
+		PyObject *kwds) {
+	static const char *kwlist[] = { "data", "exptime", "mask", NULL };
+	PyObject *odata, *omask;
+	BufferView data, mask;
+	CosmicMask bits;
+	float exptime;
+	int cols, rows, n, x, y;
+	unsigned char *m;
+
+	if (!proc_check(self) || !PyArg_ParseTupleAndKeywords(args, kwds, "OfO",
+			(char**) kwlist, &odata, &exptime, &omask)
+			|| !data.Get(odata, "data", 'f', false, 2))
+		return NULL;
+	rows = int(data.Shape(0));
+	cols = int(data.Shape(1));
+	if (!mask.Get(omask, "mask", 'B', true, 2)
+			|| !mask.Check("mask", cols, rows))
+		return NULL;
+	try {
+		NoGIL nogil;
+		boost::mutex::scoped_lock lck(*self->mtx);
+		if ((n = self->proc->DetectCosmic(data.Float(), 0, 0, cols, rows,
+				exptime, bits)) >= 0) {
+			m = (unsigned char*) mask.Data();
+			for (y = 0; y < rows; ++y) {
+				for (x = 0; x < cols; ++x, ++m)
+					*m = bits.Test(x, y);
+			}
+		}
+	}
+	catch(...) {
+		return raise_cpp_error();
+	}
+	if (n < 0) {
+		PyErr_SetString(PyExc_ValueError, "shape differs from loaded masters");
+		return NULL;
+	}
+	return PyLong_FromLong(n);
+}
+
+static PyMethodDef proc_methods[] = {
+	{ "set_detector", (PyCFunction) proc_set_detector,
+		METH_VARARGS | METH_KEYWORDS,
+		"set_detector(gain=1.0, readnoise=10.0): detector noise, e-/ADU and e-" },
+	{ "set_cosmic", (PyCFunction) proc_set_cosmic,
+		METH_VARARGS | METH_KEYWORDS,
+		"set_cosmic(enable=True, sigclip=4.5, sigfrac=0.3, objlim=5.0, "
+		"tile=256): cosmic-ray repair in calibrate()" },
+	{ "set_process", (PyCFunction) proc_set_process,
+		METH_VARARGS | METH_KEYWORDS,
+		"set_process(snr=3.0, minarea=5): detection threshold and area" },
+	{ "combine", (PyCFunction) proc_combine, METH_VARARGS | METH_KEYWORDS,
+		"combine(type, stack, out, var=None, ncomb=None, scales=None): "
+		"combine a (nframe, rows, cols) stack into out; ValueError if the "
+		"frame shape differs from loaded masters" },
+	{ "set_master", (PyCFunction) proc_set_master,
+		METH_VARARGS | METH_KEYWORDS,
+		"set_master(type, data, var=None): use an array as master frame" },
+	{ "load_master", (PyCFunction) proc_load_master, METH_VARARGS,
+		"load_master(type, path): load master frame from FITS" },
+	{ "calibrate", (PyCFunction) proc_calibrate, METH_VARARGS | METH_KEYWORDS,
+		"calibrate(data, exptime, weight=None): calibrate in place, "
+		"return number of repaired cosmic-ray pixels" },
+	{ "background", (PyCFunction) proc_background, METH_VARARGS,
+		"background(data): return (back, rms)" },
+	{ "detect", (PyCFunction) proc_detect, METH_VARARGS,
+		"detect(data): return (back, rms, [(x, y, flux, peak, area), ...])" },
+	{ "detect_cosmic", (PyCFunction) proc_detect_cosmic,
+		METH_VARARGS | METH_KEYWORDS,
+		"detect_cosmic(data, exptime, mask): flag cosmic rays of raw data "
+		"in a uint8 mask, return their number" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyType_Slot proc_slots[] = {
+	{ Py_tp_dealloc, (void*) proc_dealloc },
+	{ Py_tp_init, (void*) proc_init },
+	{ Py_tp_new, (void*) PyType_GenericNew },
+	{ Py_tp_methods, (void*) proc_methods },
+	{ Py_tp_doc, (void*) "Processor(): combine, calibrate and detect on arrays" },
+	{ 0, NULL }
+};
+
+static PyType_Spec proc_spec = {
+	"fitspre.Processor", sizeof(PyProcessor), 0, Py_TPFLAGS_DEFAULT, proc_slots
+};
+
+//////////////////////////////////////////////////////////////////////////////
+static struct PyModuleDef fitspre_module = {
+	PyModuleDef_HEAD_INIT, "fitspre",
+	"Zero-copy bindings of the fitspre FITS pre-processing kernels", -1, NULL
+};
+
+static bool add_type(PyObject *module, PyType_Spec *spec, const char *name) {
+	PyObject *type = PyType_FromSpec(spec);
+	if (!type || PyModule_AddObject(module, name, type)) {
+		Py_XDECREF(type);
+		return false;
+	}
+	return true;
+}
+
+PyMODINIT_FUNC PyInit_fitspre(void) {
+	PyObject *module = PyModule_Create(&fitspre_module);
+
+	if (!module || !add_type(module, &fits_spec, "FitsFile")
+			|| !add_type(module, &proc_spec, "Processor")
+			|| PyModule_AddIntConstant(module, "ZERO", IMGTYP_ZERO)
+			|| PyModule_AddIntConstant(module, "DARK", IMGTYP_DARK)
+			|| PyModule_AddIntConstant(module, "FLAT", IMGTYP_FLAT)) {
+		Py_XDECREF(module);
+		return NULL;
+	}
+	return module;
+}
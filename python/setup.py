@@ -0,0 +1,71 @@
+"""
+Build the fitspre Python extension.
+
+    cd python && python setup.py build_ext --inplace
+
+The C++ sources and link libraries are taken from src/Makefile.am, so the
+module always links the same kernels as the fitspre program. Only the
+Python headers are needed; arrays are exchanged through the buffer
+protocol, so NumPy is not required at build time.
+
+cfitsio is located through CFITSIO_DIR (its install prefix) when set,
+otherwise through `pkg-config cfitsio`. CPPFLAGS and LDFLAGS are honoured
+as usual, e.g.
+
+    CPPFLAGS=-I/opt/cfitsio/include LDFLAGS=-L/opt/cfitsio/lib \
+        python setup.py build_ext --inplace
+"""
+import os
+import re
+import subprocess
+from setuptools import setup, Extension
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SRC = os.path.join(HERE, os.pardir, 'src')
+
+
+def makefile_var(name):
+    with open(os.path.join(SRC, 'Makefile.am')) as f:
+        for line in f:
+            m = re.match(r'\s*%s\s*=(.*)' % name, line)
+            if m:
+                return m.group(1).split()
+    return []
+
+
+def pkg_config(option, prefix):
+    try:
+        out = subprocess.check_output(['pkg-config', option, 'cfitsio'],
+                                      stderr=subprocess.DEVNULL)
+    except (OSError, subprocess.CalledProcessError):
+        return []
+    return [s[2:] for s in out.decode().split() if s.startswith(prefix)]
+
+
+def cfitsio_dirs():
+    prefix = os.environ.get('CFITSIO_DIR')
+    if prefix:
+        return [os.path.join(prefix, 'include')], [os.path.join(prefix, 'lib')]
+    return pkg_config('--cflags-only-I', '-I'), pkg_config('--libs-only-L', '-L')
+
+
+sources = [os.path.join(SRC, s) for s in makefile_var('fitspre_SOURCES')
+           if s != 'fitspre.cpp']
+libraries = [s[2:] for s in makefile_var('fitspre_LDADD') if s.startswith('-l')]
+library_dirs = [s[2:] for s in makefile_var('fitspre_LDFLAGS')
+                if s.startswith('-L')]
+fits_include, fits_lib = cfitsio_dirs()
+
+setup(
+    name='fitspre',
+    version='1.0',
+    description='Zero-copy bindings of the fitspre FITS pre-processing kernels',
+    ext_modules=[Extension(
+        'fitspre',
+        sources=[os.path.join(HERE, 'fitspremodule.cpp')] + sources,
+        include_dirs=[SRC] + fits_include,
+        library_dirs=library_dirs + fits_lib,
+        libraries=libraries,
+        language='c++',
+    )],
+)
@@ -0,0 +1,151 @@
+"""
+Tests of the fitspre Python extension.
+
+    cd python && python setup.py build_ext --inplace && python test_fitspre.py
+
+Arrays are built with the array module, so NumPy is not needed.
+"""
+import array
+import math
+import os
+import struct
+import tempfile
+import unittest
+
+import fitspre
+
+def plane(shape, values):
+    """C-contiguous float32 buffer of the given shape."""
+    n = 1
+    for s in shape:
+        n *= s
+    if not isinstance(values, (list, tuple)):
+        values = [values] * n
+    assert len(values) == n
+    return memoryview(array.array('f', values)).cast('B').cast('f', shape)
+
+
+def write_fits(path, rows, cols, values, exptime):
+    """Minimal primary-HDU FITS file with BITPIX = -32."""
+    cards = ['SIMPLE  = %20s' % 'T', 'BITPIX  = %20d' % -32, 'NAXIS   = %20d' % 2,
+             'NAXIS1  = %20d' % cols, 'NAXIS2  = %20d' % rows,
+             'EXPTIME = %20.3f' % exptime, 'END']
+    head = ''.join(c.ljust(80) for c in cards).encode('ascii')
+    data = struct.pack('>%df' % len(values), *values)
+    with open(path, 'wb') as f:
+        for block in (head, data):
+            f.write(block + (b' ' if block is head else b'\0') * (-len(block) % 2880))
+
+
+class FitsFileTest(unittest.TestCase):
+    """Buffer round-trip through FitsFile."""
+
+    rows, cols = 6, 7
+
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp(suffix='.fit')
+        os.close(fd)
+        self.values = [float(i * 3 % 11) - 2.5 for i in range(self.rows * self.cols)]
+        write_fits(self.path, self.rows, self.cols, self.values, 30.0)
+
+    def tearDown(self):
+        os.remove(self.path)
+
+    def test_round_trip(self):
+        fits = fitspre.FitsFile(self.path)
+        self.assertEqual(fits.shape, (self.rows, self.cols))
+        self.assertAlmostEqual(fits.exptime, 30.0)
+        image = plane((self.rows, self.cols), 0.0)
+        fits.read_image(image)
+        self.assertEqual(list(image.cast('B').cast('f')), self.values)
+        row = plane((self.cols - 2,), 0.0)
+        fits.read(row, row=3, col=2)
+        first = 3 * self.cols + 2
+        self.assertEqual(list(row), self.values[first:first + self.cols - 2])
+        with self.assertRaises(ValueError):
+            fits.read(row, row=self.rows - 1, col=self.cols - 1)
+        fits.close()
+        with self.assertRaises(ValueError):
+            fits.read_image(image)
+
+    def test_missing_file(self):
+        with self.assertRaises(OSError):
+            fitspre.FitsFile(self.path + '.missing')
+
+
+class SmallStackTest(unittest.TestCase):
+    """Three frames: the minimum a combine accepts."""
+
+    rows, cols = 4, 5
+
+    def stack(self, levels):
+        pixels = self.rows * self.cols
+        values = []
+        for k, level in enumerate(levels):
+            values += [level + 0.1 * ((i * 7 + k * 3) % 5) for i in range(pixels)]
+        return plane((len(levels), self.rows, self.cols), values)
+
+    def combine(self, type, levels, **kw):
+        shape = (self.rows, self.cols)
+        out, var, ncomb = plane(shape, 0.0), plane(shape, -1.0), plane(shape, -1.0)
+        fitspre.Processor().combine(type, self.stack(levels), out, var=var,
+                                    ncomb=ncomb, **kw)
+        return out, var, ncomb
+
+    def check(self, out, var, ncomb, lo, hi):
+        for r in range(self.rows):
+            for c in range(self.cols):
+                self.assertTrue(lo <= out[r, c] <= hi)
+                self.assertTrue(math.isfinite(var[r, c]))
+                self.assertGreater(var[r, c], 0.0)
+                self.assertEqual(ncomb[r, c], 3)
+
+    def test_flat_three_frames(self):
+        out, var, ncomb = self.combine(fitspre.FLAT, [1000.0, 1010.0, 990.0])
+        self.check(out, var, ncomb, 0.9, 1.1)
+
+    def test_zero_three_frames(self):
+        out, var, ncomb = self.combine(fitspre.ZERO, [100.0, 101.0, 99.0])
+        self.check(out, var, ncomb, 99.0, 101.5)
+
+
+class BlankPixelTest(unittest.TestCase):
+    """Undefined pixels (BLANK read as NaN) are skipped, not propagated."""
+
+    def test_combine_skips_nan(self):
+        rows, cols, nan = 2, 3, float('nan')
+        values = [100.0 + k + 0.1 * i for k in range(4) for i in range(rows * cols)]
+        values[1] = nan                       # one frame undefined at (0, 1)
+        for k in range(4):                    # all frames undefined at (1, 2)
+            values[k * rows * cols + 5] = nan
+        stack = plane((4, rows, cols), values)
+        out, var, ncomb = (plane((rows, cols), 0.0) for i in range(3))
+        fitspre.Processor().combine(fitspre.ZERO, stack, out, var=var, ncomb=ncomb)
+        self.assertEqual(ncomb[0, 0], 2)
+        self.assertEqual(ncomb[0, 1], 3)
+        self.assertTrue(math.isfinite(out[0, 1]) and math.isfinite(var[0, 1]))
+        self.assertEqual(ncomb[1, 2], 0)
+        self.assertTrue(math.isnan(out[1, 2]))
+
+    def test_detect_next_to_nan(self):
+        rows, cols = 32, 32
+        values = [10.0 + 0.5 * ((x * 3 + y * 5) % 4) for y in range(rows)
+                  for x in range(cols)]
+        for y in range(14, 17):
+            for x in range(14, 17):
+                values[y * cols + x] = 500.0
+        values[14 * cols + 13] = float('nan')  # scanned just before the star
+        data = plane((rows, cols), values)
+        proc = fitspre.Processor()
+        back, rms = proc.background(data)
+        self.assertTrue(math.isfinite(back) and math.isfinite(rms))
+        back, rms, objects = proc.detect(data)
+        self.assertEqual(len(objects), 1)
+        x, y, flux, peak, area = objects[0]
+        self.assertAlmostEqual(x, 15.0, places=3)
+        self.assertAlmostEqual(y, 15.0, places=3)
+        self.assertEqual(area, 9)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -2,86 +2,139 @@
  * @file ADIProcess.cpp FITS图像处理接口
  */
 #include <boost/make_shared.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <algorithm>
+#include <fstream>
+#include <limits>
 #include <vector>
 #include "ADIProcess.h"
+#include "TaskGraph.h"
+#include "FrameIndex.h"
 
 using namespace std;
 using namespace boost::filesystem;
 using namespace boost::posix_time;
+using namespace boost::placeholders;
 
 namespace AstroUtil {
+// 合并后标定图像文件名. 下标为图像类型
+const char *master_name[] = { "ZERO.fit", "DARK.fit", "FLAT.fit" };
+// cfitsio为每个打开的文件分配的I/O缓存, 量纲: 字节
+const size_t FITS_HANDLE_BYTES = 40 * 2880;
+// 合并时每次读取的最大行数
+const int MAX_ROWS_BLOCK = 64;
+// 逐行抽样统计时的抽样行数与样本数
+const int SAMPLE_ROWS = 100;
+const int SAMPLE_PIXELS = 10000;
+// 16位输出时每次量化并写入的像素数
+const int QUANT_BLOCK = 65536;
+// 16位整数输出时无效像素的取值
+const int QUANT_BLANK = -32768;
+// 16位输出时量化误差与噪声之比的上限
+const float QUANT_NOISE_RATIO = 0.25;
+// 叠加时降采样图像的最大尺寸
+const int MAX_XCORR_SIZE = 1024;
+// 叠加时精化偏移的窗口尺寸
+const int REFINE_SIZE = 256;
+// 宇宙线识别时分块的外扩像素数. 覆盖各级滤波的累积半径
+const int COSMIC_HALO = 8;
+// 每个标定图像驻留的数据平面数: 合并结果、方差和参与合并的帧数
+const int MASTER_PLANES = 3;
+// 复数频谱每个元素占用的float数
+const int CPLX_FLOATS = sizeof(cplx) / sizeof(float);
+// 标定图像方差和参与合并帧数的扩展名
+const char *EXT_VARIANCE = "VARIANCE";
+const char *EXT_NCOMB = "NCOMB";
+// 分片合并计划文件格式标识
+const char *SHARD_PLAN_MAGIC = "# fitspre shard plan v1";
+
 FitsHPtr make_fits_handler() {
 	return boost::make_shared<FitsHandler>();
 }
 
+/*
+ * 依据关键字IMAGETYP及曝光时间判定标定图像类型
+ * - 暗场和平场须具有正曝光时间
+ * - 缺少IMAGETYP时, 曝光时间为0的图像视为本底
+ * 无法判定或类型与曝光时间矛盾时返回-1
+ */
+static int calib_type(const frame_info &info) {
+	string imgtyp = boost::to_upper_copy(info.imgtyp);
+	int type(-1);
+
+	if (imgtyp.find("FLAT") != string::npos)
+		type = IMGTYP_FLAT;
+	else if (imgtyp.find("DARK") != string::npos)
+		type = IMGTYP_DARK;
+	else if (imgtyp.find("BIAS") != string::npos
+			|| imgtyp.find("ZERO") != string::npos
+			|| (imgtyp.empty() && info.exptime == 0.0))
+		type = IMGTYP_ZERO;
+	if (type != IMGTYP_ZERO && !(info.exptime > 0.0))
+		type = -1;
+	return type;
+}
+
 FitsNFPtr make_fits_info() {
 	FitsNFPtr nfptr = boost::make_shared<FitsInfo>();
 	nfptr->hptr = make_fits_handler();
+	nfptr->scale = nfptr->median = nfptr->rms = nfptr->satfrac = 0.0;
+	nfptr->exptime = nfptr->dx = nfptr->dy = 0.0;
 	return nfptr;
 }
 
+/*
+ * 宇宙线识别时单个线程的分块缓存区长度, 量纲: float
+ * - 5个数据平面及滤波临时区: 6 * n, n = w * w
+ * - 候选标记和扩展标记各一个平面, 以char存储
+ * 长度取64字节的整数倍, 各线程缓存区不共享缓存行
+ */
+static size_t cosmic_thread_floats(int tile) {
+	size_t w = tile + 2 * COSMIC_HALO, n = w * w;
+	n = 6 * n + (2 * n + sizeof(float) - 1) / sizeof(float);
+	return (n + 15) / 16 * 16;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 ADIProcess::ADIProcess() {
-
+	info_.valid_zero = info_.valid_dark = info_.valid_flat = false;
+	info_.wdim = info_.hdim = 0;
+	mem_budget_ = 0;
+	zcoef_[0] = zcoef_[1] = zcoef_[2] = 0.0;
+	outmode_ = OUTPUT_FLOAT;
+	weight_ = false;
+	quant_.nframe = quant_.nfloat = 0;
+	quant_.ratio_max = 0.0;
+	writer_.SetHandler(boost::bind(&ADIProcess::write_job, this, _1));
 }
 
 ADIProcess::~ADIProcess() {
+	writer_.Flush();
 }
 
 bool ADIProcess::CombineZero(const string &pathname, const string &prefix) {
 	FitsNFPtrVec fhvec;
-	if (!scan_directory(pathname, prefix, fhvec))
+	mem_plan plan;
+	if (!scan_directory(pathname, prefix, fhvec)
+			|| !prepare_combine(IMGTYP_ZERO, fhvec)
+			|| !share_memory(resident_planes() + MASTER_PLANES,
+					level_bytes(fhvec.size(), info_.hdim) + writer_bytes(0), 1,
+					plan, (fhvec.size() + 1) * FITS_HANDLE_BYTES)
+			|| !screen_frames(IMGTYP_ZERO, fhvec, plan)
+			|| !combine_master(IMGTYP_ZERO, fhvec, plan))
 		return false;
-	int rows, cols, pos, row, col, off1, off2;
-	int nfile(fhvec.size()), ifile;
-	fltarr rowbuff, pixbuff;
-
-	fhvec[0]->hptr->GetDimension(cols, rows);
-	rowbuff.reset(new float[nfile * cols]); // 所有文件的行数据
-	pixbuff.reset(new float[nfile]); // 所有文件的点数据
-	zero_.reset(new float[rows * cols]); // 处理结果
-	info_.valid_zero = false;
-	info_.wdim = cols;
-	info_.hdim = rows;
-
-	// 合并图像
-	for (row = pos = 0; row < rows; ++row) { // 逐行遍历
-		// 读出各文件行数据
-		for (ifile = 0, off1 = 0; ifile < nfile; ++ifile, off1 += cols) {
-			fhvec[ifile]->hptr->LoadPixels(rowbuff.get() + off1, cols, row);
-		}
-		for (col = 0; col < cols; ++col, ++pos) {
-			// 加载各文件(col, row)位置数据
-			for (ifile = 0, off1 = col; ifile < nfile; ++ifile, off1 += cols) {
-				pixbuff[ifile] = rowbuff[off1];
-			}
-			zero_[pos] = minmax_clip(pixbuff.get(), nfile);
-		}
-	}
-	// 输出合并结果
 	path dst = pathname;
-	FitsHPtr fhptr;
-
-	dst /= path("ZERO.fit");
-	fhptr = output_image(zero_.get(), cols, rows, dst.string());
-	if (!fhptr.unique())
-		return false;
-
-	int status(0);
-	string dateobs = boost::posix_time::to_iso_extended_string(
-			second_clock::universal_time());
-	fits_write_key((*fhptr)(), TSTRING, "DATE-OBS", (void*) dateobs.c_str(),
-			"time of file genernated", &status);
-
-	info_.valid_zero = !status;
-	return info_.valid_zero;
+	dst /= path(master_name[IMGTYP_ZERO]);
+	return (info_.valid_zero = write_master(IMGTYP_ZERO, dst.string()));
 }
 
 bool ADIProcess::SetZero(const string &filepath) {
@@ -92,9 +145,10 @@ bool ADIProcess::SetZero(const string &filepath) {
 	bool same;
 
 	fh.GetDimension(cols, rows);
-	if ((pixels = rows * cols) > 0 && pixels != info_.pixels()) {
-		zero_.reset(new float[pixels]);
+	if ((pixels = rows * cols) > 0) {
+		zero_ = pool_.Alloc(pixels);
 		if ((info_.valid_zero = fh.LoadImage(zero_.get()))) {
+			load_variance(fh, IMGTYP_ZERO);
 			// 检查暗场和平场是否合法
 			same = rows == info_.hdim && cols == info_.wdim;
 			if (!same) {
@@ -110,89 +164,631 @@ bool ADIProcess::SetZero(const string &filepath) {
 }
 
 bool ADIProcess::CombineDark(const string &pathname, const string &prefix) {
-	return true;
+	FitsNFPtrVec fhvec;
+	mem_plan plan;
+	if (!scan_directory(pathname, prefix, fhvec)
+			|| !prepare_combine(IMGTYP_DARK, fhvec)
+			|| !share_memory(resident_planes() + MASTER_PLANES,
+					level_bytes(fhvec.size(), info_.hdim) + writer_bytes(0), 1,
+					plan, (fhvec.size() + 1) * FITS_HANDLE_BYTES)
+			|| !screen_frames(IMGTYP_DARK, fhvec, plan)
+			|| !combine_master(IMGTYP_DARK, fhvec, plan))
+		return false;
+	path dst = pathname;
+	dst /= path(master_name[IMGTYP_DARK]);
+	return (info_.valid_dark = write_master(IMGTYP_DARK, dst.string()));
 }
 
 bool ADIProcess::SetDark(const string &filepath) {
+	info_.valid_dark = load_master(IMGTYP_DARK, filepath);
 
 	return info_.valid_dark;
 }
 
 bool ADIProcess::CombineFlat(const string &pathname, const string &prefix) {
 	FitsNFPtrVec fhvec;
+	mem_plan plan;
+
+	if (!scan_directory(pathname, prefix, fhvec)
+			|| !prepare_combine(IMGTYP_FLAT, fhvec)
+			|| !share_memory(resident_planes() + MASTER_PLANES,
+					level_bytes(fhvec.size(), info_.hdim) + writer_bytes(0), 1,
+					plan, (fhvec.size() + 1) * FITS_HANDLE_BYTES)
+			|| !screen_frames(IMGTYP_FLAT, fhvec, plan)
+			|| !normal_scales(fhvec, plan)
+			|| !combine_master(IMGTYP_FLAT, fhvec, plan))
+		return false;
+	// 剔除噪声
+//	remove_noise(dstbuff.get(), cols, rows); // CMOS相机 效果不明显. 2019-06-12
+	// 输出合并结果
+	path dst = pathname;
+	dst /= path(master_name[IMGTYP_FLAT]);
+	return (info_.valid_flat = write_master(IMGTYP_FLAT, dst.string()));
+}
+
+bool ADIProcess::SetFlat(const string &filepath) {
+	info_.valid_flat = load_master(IMGTYP_FLAT, filepath);
 
-	if (!scan_directory(pathname, prefix, fhvec))
+	return info_.valid_flat;
+}
+
+bool ADIProcess::CombineAll(const param_calib &param) {
+	FitsNFPtrVec fhvec[3];
+	if (!scan_calibration(param, fhvec))
 		return false;
-	int rows, cols, pos, row, col, off1, off2, off3;
-	int nfile(fhvec.size()), ifile;
-	fltarr rowbuff, pixbuff;
-	float expt;
 
-	fhvec[0]->hptr->GetDimension(cols, rows);
-	rowbuff.reset(new float[nfile * cols]); // 所有文件的行数据
-	pixbuff.reset(new float[nfile]); // 所有文件的点数据
-	flat_.reset(new float[rows * cols]); // 处理结果
+	TaskGraph graph;
+	mem_plan plan;
+	int tzero(-1), tscale(-1), tcomb, type;
+	int nplane(resident_planes()), nhandle(0);
+	string dirs[] = { param.dir_zero, param.dir_dark, param.dir_flat };
+	path dst[3];
 
-	// 统计归一化比例尺
-	for (ifile = 0; ifile < nfile; ++ifile) {
-		fhvec[ifile]->scale = normal_scale(fhvec[ifile]->hptr);
+	// 已加载的同类标定图像在合并前释放, 此处仍计入驻留内存
+	for (type = IMGTYP_ZERO; type <= IMGTYP_FLAT; ++type) {
+		dst[type] = param.dir_output.empty() ? dirs[type] : param.dir_output;
+		dst[type] /= path(master_name[type]);
+		nhandle += fhvec[type].size();
+		if (fhvec[type].size())
+			nplane += MASTER_PLANES;
+	}
+	// 至多两个合并任务并行执行
+	if (!share_memory(nplane, level_bytes(nhandle, info_.hdim)
+			+ writer_bytes(0), 2, plan, (nhandle + 1) * FITS_HANDLE_BYTES))
+		return false;
+	// 合并前筛选图像质量
+	for (type = IMGTYP_ZERO; type <= IMGTYP_FLAT; ++type) {
+		if (fhvec[type].size() && !screen_frames(type, fhvec[type], plan))
+			fhvec[type].clear();
+	}
+	/* 依赖关系:
+	 * - 本底合并完成后, 即可在内存中为暗场和平场扣除本底
+	 * - 平场比例尺统计不依赖本底, 与本底合并并行执行
+	 * - 写文件不阻塞后续合并步骤
+	 */
+	if (fhvec[IMGTYP_ZERO].size()) {
+		tzero = graph.AddTask(boost::bind(&ADIProcess::combine_master, this,
+				int(IMGTYP_ZERO), boost::ref(fhvec[IMGTYP_ZERO]), plan));
+		graph.AddTask(boost::bind(&ADIProcess::write_master, this,
+				int(IMGTYP_ZERO), dst[IMGTYP_ZERO].string()), tzero);
+	}
+	if (fhvec[IMGTYP_DARK].size()) {
+		tcomb = graph.AddTask(boost::bind(&ADIProcess::combine_master, this,
+				int(IMGTYP_DARK), boost::ref(fhvec[IMGTYP_DARK]), plan), tzero);
+		graph.AddTask(boost::bind(&ADIProcess::write_master, this,
+				int(IMGTYP_DARK), dst[IMGTYP_DARK].string()), tcomb);
+	}
+	if (fhvec[IMGTYP_FLAT].size()) {
+		tscale = graph.AddTask(boost::bind(&ADIProcess::normal_scales, this,
+				boost::ref(fhvec[IMGTYP_FLAT]), plan));
+		tcomb = graph.AddTask(boost::bind(&ADIProcess::combine_master, this,
+				int(IMGTYP_FLAT), boost::ref(fhvec[IMGTYP_FLAT]), plan), tzero,
+				tscale);
+		graph.AddTask(boost::bind(&ADIProcess::write_master, this,
+				int(IMGTYP_FLAT), dst[IMGTYP_FLAT].string()), tcomb);
 	}
 
-	// 合并图像
-	for (row = pos = off3 = 0; row < rows; ++row, off3 += cols) { // 逐行遍历
-		// 读出各文件行数据
-		for (ifile = 0, off1 = 0; ifile < nfile; ++ifile, off1 += cols) {
-			fhvec[ifile]->hptr->LoadPixels(rowbuff.get() + off1, cols, row);
-		}
-		if (info_.valid_zero) {		// 本底
-			float bias;
-			// 减本底
-			for (col = 0, off2 = off3; col < cols; ++col, ++off2) {
-				bias = zero_[off2];
-				for (ifile = 0, off1 = col; ifile < nfile;
-						++ifile, off1 += cols) {
-					rowbuff[off1] -= bias;
-				}
-			}
+	bool rslt = graph.Run(param.nthread);
+	return writer_.Flush() && rslt;
+}
+
+bool ADIProcess::PrepareShard(int type, const string &pathname,
+		const string &prefix, const string &output) {
+	if (type < IMGTYP_ZERO || type > IMGTYP_FLAT)
+		return false;
+	FitsNFPtrVec fhvec;
+	return select_shard(type, pathname, prefix, fhvec)
+			&& save_shard_plan(type, pathname, prefix, output, fhvec);
+}
+
+bool ADIProcess::CombineShard(int type, const string &pathname,
+		const string &prefix, const string &output, int ishard, int nshard) {
+	if (type < IMGTYP_ZERO || type > IMGTYP_FLAT || ishard < 0
+			|| ishard >= nshard)
+		return false;
+	FitsNFPtrVec fhvec;
+	if (!load_shard_plan(type, pathname, prefix, output, fhvec)
+			&& !select_shard(type, pathname, prefix, fhvec))
+		return false;
+
+	int cols(info_.wdim), rows(info_.hdim);
+	int row0(int(double(rows) * ishard / nshard));
+	int row1(int(double(rows) * (ishard + 1) / nshard));
+	fltarr data, var, ncomb;
+	mem_plan plan;
+
+	// 分片结果以引用提交写入, 不另行复制
+	if (row1 <= row0 || !share_memory(resident_planes(),
+			level_bytes(fhvec.size(), info_.hdim) + size_t(MASTER_PLANES)
+					* (row1 - row0) * cols * sizeof(float) + writer_bytes(0), 1,
+			plan, (fhvec.size() + 1) * FITS_HANDLE_BYTES))
+		return false;
+	data = pool_.Alloc((row1 - row0) * cols);
+	var = pool_.Alloc((row1 - row0) * cols);
+	ncomb = pool_.Alloc((row1 - row0) * cols);
+	if (!combine_band(type, fhvec, row0, row1, plan, data.get(), var.get(),
+			ncomb.get()))
+		return false;
+
+	// 局部文件总是32位输出
+	out_job job;
+	job.filepath = shard_filepath(type, output, ishard, nshard);
+	job.data = data;
+	job.cols = cols;
+	job.rows = row1 - row0;
+	job.mode = OUTPUT_FLOAT;
+	job.AddKey("BANDR0", TINT, row0, "first row of band in master");
+	job.AddKey("BANDR1", TINT, row1, "end row of band in master, exclusive");
+	job.AddKey("FULLROWS", TINT, rows, "rows of master");
+	if (type != IMGTYP_ZERO)
+		job.AddKey("ZEROCOEF", TFLOAT, zero_coef(fhvec),
+				"variance includes ZEROCOEF^2 * ZERO variance");
+	job.AddExt(EXT_VARIANCE, FLOAT_IMG, var);
+	job.AddExt(EXT_NCOMB, SHORT_IMG, ncomb);
+	data.reset();
+	var.reset();
+	ncomb.reset();
+	return writer_.Submit(job) && writer_.Flush();
+}
+
+bool ADIProcess::MergeShard(int type, const string &pathname, int nshard,
+		int timeout) {
+	if (type < IMGTYP_ZERO || type > IMGTYP_FLAT || nshard <= 0)
+		return false;
+	vector<string> files;
+	int ishard, seconds;
+
+	// 等待全部局部文件
+	for (ishard = 0; ishard < nshard; ++ishard)
+		files.push_back(shard_filepath(type, pathname, ishard, nshard));
+	for (ishard = seconds = 0; ishard < nshard;) {
+		if (exists(files[ishard]))
+			++ishard;
+		else if (seconds++ < timeout)
+			sleep(1);
+		else
+			return false;
+	}
+
+	// 拼接各分片
+	FitsHandler fh;
+	fltarr data, var, ncomb;
+	mem_plan plan;
+	int cols(0), rows(0), cols1, rows1, row0, row1, fullrows, status, status1;
+	float zcoef(0.0);
+	bool hasvar(true);
+
+	for (ishard = 0, row1 = 0; ishard < nshard; ++ishard) {
+		if (!fh.Open(files[ishard].c_str()))
+			return false;
+		fh.GetDimension(cols1, rows1);
+		{
+			FitsLock lck;
+			status = status1 = 0;
+			fits_read_key(fh(), TINT, "BANDR0", &row0, NULL, &status);
+			fits_read_key(fh(), TINT, "FULLROWS", &fullrows, NULL, &status);
+			// 各分片系数相同
+			if (!ishard && fits_read_key(fh(), TFLOAT, "ZEROCOEF", &zcoef,
+					NULL, &status1))
+				zcoef = 0.0;
 		}
-		// 合并该行各像素
-		for (col = 0; col < cols; ++col, ++pos) {
-			// 加载各文件(col, row)位置数据
-			for (ifile = 0, off1 = col; ifile < nfile; ++ifile, off1 += cols) {
-				pixbuff[ifile] = rowbuff[off1] / fhvec[ifile]->scale;
-			}
-			flat_[pos] = avsigclip(pixbuff.get(), nfile);
+		if (status || row0 != row1)
+			return false;
+		if (!ishard) {
+			cols = cols1;
+			rows = fullrows;
+			if (!share_memory(resident_planes(), size_t(MASTER_PLANES) * cols
+					* rows * sizeof(float) + writer_bytes(0), 1, plan,
+					2 * FITS_HANDLE_BYTES))
+				return false;
+			data = pool_.Alloc(cols * rows);
+			var = pool_.Alloc(cols * rows);
+			ncomb = pool_.Alloc(cols * rows);
+		} else if (cols1 != cols || fullrows != rows) {
+			return false;
 		}
+		if ((row1 = row0 + rows1) > rows
+				|| !fh.LoadImage(data.get() + row0 * cols))
+			return false;
+		// 任一分片缺少方差时, 结果不含方差
+		hasvar = hasvar
+				&& fh.LoadExtension(EXT_VARIANCE, var.get() + row0 * cols)
+				&& fh.LoadExtension(EXT_NCOMB, ncomb.get() + row0 * cols);
 	}
-	// 剔除噪声
-//	remove_noise(dstbuff.get(), cols, rows); // CMOS相机 效果不明显. 2019-06-12
+	if (row1 != rows || !prepare_dimension(type, cols, rows))
+		return false;
+	if (type == IMGTYP_ZERO)
+		zero_ = data;
+	else if (type == IMGTYP_DARK)
+		dark_ = data;
+	else
+		flat_ = data;
+	var_[type] = hasvar ? var : fltarr();
+	ncomb_[type] = hasvar ? ncomb : fltarr();
+	zcoef_[type] = hasvar ? zcoef : 0.0;
+
 	// 输出合并结果
 	path dst = pathname;
-	FitsHPtr fhptr;
+	bool rslt;
+
+	dst /= path(master_name[type]);
+	rslt = write_master(type, dst.string()) && writer_.Flush();
+	if (type == IMGTYP_ZERO)
+		info_.valid_zero = rslt;
+	else if (type == IMGTYP_DARK)
+		info_.valid_dark = rslt;
+	else
+		info_.valid_flat = rslt;
+	if (rslt) {
+		boost::system::error_code ec;
+		for (ishard = 0; ishard < nshard; ++ishard)
+			remove(files[ishard], ec);
+		remove(shard_planpath(type, pathname), ec);
+	}
+	return rslt;
+}
+
+void ADIProcess::SetMemoryBudget(size_t bytes) {
+	mem_budget_ = bytes;
+	pool_.SetLimit(bytes);
+}
+
+void ADIProcess::SetHugePage(bool enable) {
+	pool_.SetHugePage(enable);
+}
+
+void ADIProcess::SetOverscan(const param_overscan &param) {
+	overscan_ = param;
+}
+
+bool ADIProcess::Coadd(const param_coadd &param) {
+	FitsNFPtrVec fhvec;
+	mem_plan plan;
+	int cols, rows;
+	double exptime(0.0);
 
-	dst /= path("FLAT.fit");
-	fhptr = output_image(flat_.get(), cols, rows, dst.string());
-	if (!fhptr.unique())
+	coadd_ = param;
+	if (!scan_directory(param.dir, param.prefix, fhvec))
+		return false;
+	fhvec[0]->hptr->GetDimension(cols, rows);
+	if (!info_.same_dimension(cols, rows)) {
+		if (info_.valid_zero || info_.valid_dark || info_.valid_flat)
+			return false;
+		info_.wdim = cols;
+		info_.hdim = rows;
+	}
+	for (FitsNFPtrVec::iterator it = fhvec.begin(); it != fhvec.end(); ++it)
+		(*it)->exptime = (*it)->hptr->GetExptime();
+	// 叠加结果以引用提交写入
+	if (!share_memory(resident_planes() + 1, level_bytes(fhvec.size(),
+			info_.hdim) + writer_bytes(0), 1, plan,
+			(fhvec.size() + 1) * FITS_HANDLE_BYTES)
+			|| !estimate_offsets(fhvec, plan))
 		return false;
 
-	int status(0);
-	string dateobs = boost::posix_time::to_iso_extended_string(
-			second_clock::universal_time());
-	expt = 1.0;
-	fits_write_key((*fhptr)(), TSTRING, "DATE-OBS", (void*) dateobs.c_str(),
-			"time of file genernated", &status);
-	fits_write_key((*fhptr)(), TFLOAT, "EXPTIME", &expt, "Exposure duration",
-			&status);
+	out_job job;
+	job.data = pool_.Alloc(info_.pixels());
+	if (!combine_band(IMGTYP_OBJECT, fhvec, 0, rows, plan, job.data.get()))
+		return false;
+	for (FitsNFPtrVec::iterator it = fhvec.begin(); it != fhvec.end(); ++it)
+		exptime += (*it)->exptime;
+	job.filepath = param.output;
+	job.cols = cols;
+	job.rows = rows;
+	job.mode = outmode_;
+	job.AddKey("DATE-OBS", boost::posix_time::to_iso_extended_string(
+			second_clock::universal_time()), "time of file genernated");
+	job.AddKey("EXPTIME", TFLOAT, exptime / fhvec.size(),
+			"mean exposure duration of frames");
+	job.AddKey("NCOMBINE", TINT, fhvec.size(), "number of frames combined");
+	return writer_.Submit(job) && writer_.Flush();
+}
 
-	if (!status)
-		info_.valid_flat = true;
+bool ADIProcess::Flush(vector<string> *failed) {
+	return writer_.Flush(failed);
+}
 
-	return false;
+void ADIProcess::SetWriteQueue(int n) {
+	writer_.SetCapacity(n);
 }
 
-bool ADIProcess::SetFlat(const string &filepath) {
+void ADIProcess::SetProcess(const param_dip &param) {
+	dip_ = param;
+}
 
-	return info_.valid_flat;
+bool ADIProcess::ProcessROI(const string &filepath, const param_roi &roi,
+		roi_result &rslt) {
+	FitsHPtr fhptr = make_fits_handler();
+	mem_plan plan;
+	int rows, cols, x0(roi.x0), y0(roi.y0), w(roi.width), h(roi.height), i;
+	size_t pixels;
+	double x, y;
+
+	if (!open_frame(fhptr, filepath))
+		return false;
+	fhptr->GetDimension(cols, rows);
+	if ((info_.valid_zero || info_.valid_dark || info_.valid_flat)
+			&& !info_.same_dimension(cols, rows))
+		return false;
+	if (roi.sky) {
+		if (!fhptr->SkyToPixel(roi.ra, roi.dec, x, y))
+			return false;
+		x0 = int(floor(x + 0.5)) - w / 2;
+		y0 = int(floor(y + 0.5)) - h / 2;
+	}
+	// 裁剪至图像内
+	if (x0 < 0) {
+		w += x0;
+		x0 = 0;
+	}
+	if (y0 < 0) {
+		h += y0;
+		y0 = 0;
+	}
+	if (x0 + w > cols)
+		w = cols - x0;
+	if (y0 + h > rows)
+		h = rows - y0;
+	if (w <= 0 || h <= 0)
+		return false;
+	// 区域数据, 宇宙线标记, 以及信号提取的像素标记和栈
+	pixels = size_t(w) * h;
+	if (!share_memory(resident_planes(), level_bytes(1, rows)
+			+ pixels * (sizeof(float) + sizeof(char) + sizeof(int)), 1, plan,
+			FITS_HANDLE_BYTES + (cosmic_.enable ? CosmicMask::Bytes(w, h) : 0)))
+		return false;
+
+	// 逐行读取区域数据
+	rslt.x0 = x0;
+	rslt.y0 = y0;
+	rslt.width = w;
+	rslt.height = h;
+	rslt.data = pool_.Alloc(w * h);
+	for (i = 0; i < h; ++i) {
+		if (!fhptr->LoadPixels(rslt.data.get() + i * w, w, y0 + i, x0))
+			return false;
+	}
+	rslt.exptime = fhptr->GetExptime();
+	if (cosmic_.enable) {
+		CosmicMask mask;
+		if (detect_cosmic(rslt.data.get(), x0, y0, w, h, rslt.exptime, mask,
+				plan) < 0)
+			return false;
+		pre_process(rslt.data.get(), x0, y0, w, h, rslt.exptime, &mask);
+	} else
+		pre_process(rslt.data.get(), x0, y0, w, h, rslt.exptime);
+	rslt.objects.clear();
+	ExtractObjects(rslt.data.get(), w, h, rslt.back, rslt.rms, rslt.objects);
+	for (ObjectVec::iterator it = rslt.objects.begin();
+			it != rslt.objects.end(); ++it) {
+		it->x += x0;
+		it->y += y0;
+	}
+	return true;
+}
+
+void ADIProcess::SetCosmic(const param_cosmic &param) {
+	cosmic_ = param;
+}
+
+void ADIProcess::SetDetector(const param_detector &param) {
+	detector_ = param;
+}
+
+void ADIProcess::SetWeightMap(bool enable) {
+	weight_ = enable;
+}
+
+int ADIProcess::DetectCosmic(const float *data, int x0, int y0, int width,
+		int height, float exptime, CosmicMask &mask) {
+	mem_plan plan;
+	// 单帧处理不经合并入口, 按驻留的标定图像自行分配预算
+	if (!share_memory(resident_planes(), 0, 1, plan,
+			CosmicMask::Bytes(width, height)))
+		return -1;
+	return detect_cosmic(data, x0, y0, width, height, exptime, mask, plan);
+}
+
+int ADIProcess::detect_cosmic(const float *data, int x0, int y0, int width,
+		int height, float exptime, CosmicMask &mask, mem_plan plan) {
+	cosmic_ctx ctx;
+
+	mask.Reset(x0, y0, width, height);
+	ctx.tile = (max(cosmic_.tile, 32) + 31) / 32 * 32;
+	if (!plan_cosmic(ctx.tile, plan))
+		return -1;
+	ctx.data = data;
+	ctx.x0 = x0;
+	ctx.y0 = y0;
+	ctx.width = width;
+	ctx.height = height;
+	ctx.exptime = exptime;
+	ctx.ntx = (width + ctx.tile - 1) / ctx.tile;
+	ctx.nty = (height + ctx.tile - 1) / ctx.tile;
+	ctx.mask = &mask;
+	if (plan.nthread > ctx.ntx * ctx.nty)
+		plan.nthread = ctx.ntx * ctx.nty;
+	ctx.stride = cosmic_thread_floats(ctx.tile);
+	ctx.buff = pool_.Alloc(plan.nthread * ctx.stride);
+	if (!parallel_for(ctx.ntx * ctx.nty, plan.nthread,
+			boost::bind(&ADIProcess::cosmic_tile, this, &ctx, _1, _2)))
+		return -1;
+	return mask.Count();
+}
+
+bool ADIProcess::ProcessImage(const string &filepath, const string &output) {
+	FitsHPtr fhptr = make_fits_handler();
+	out_job job;
+	fltarr weight;
+	mem_plan plan;
+	int cols, rows, ncosmic(0);
+	size_t frame_bytes;
+	float exptime;
+
+	if (!open_frame(fhptr, filepath))
+		return false;
+	fhptr->GetDimension(cols, rows);
+	if ((info_.valid_zero || info_.valid_dark || info_.valid_flat)
+			&& !info_.same_dimension(cols, rows))
+		return false;
+	// 单帧数据及权重: 处理中一份, 异步写入队列中及写入中各一份
+	frame_bytes = size_t(cols) * rows * sizeof(float) * (weight_ ? 2 : 1);
+	if (!share_memory(resident_planes(), level_bytes(1, rows) + frame_bytes
+			+ writer_bytes(frame_bytes), 1, plan, 2 * FITS_HANDLE_BYTES
+			+ (cosmic_.enable ? CosmicMask::Bytes(cols, rows) : 0)))
+		return false;
+	job.data = pool_.Alloc(cols * rows);
+	if (!fhptr->LoadImage(job.data.get()))
+		return false;
+	exptime = fhptr->GetExptime();
+	if (weight_)
+		weight = pool_.Alloc(cols * rows);
+	if ((ncosmic = calibrate_frame(job.data.get(), cols, rows, exptime,
+			weight.get(), plan)) < 0)
+		return false;
+
+	job.filepath = output;
+	job.cols = cols;
+	job.rows = rows;
+	job.mode = outmode_;
+	// 保留原始文件头, 仅添加处理相关的关键字
+	fhptr->GetHeader(job.cards);
+	if (cosmic_.enable)
+		job.AddKey("NCOSMIC", TINT, ncosmic, "number of cosmic-ray pixels repaired");
+	if (weight_) {
+		job.AddKey("GAIN", TFLOAT, detector_.gain, "gain used by weight, e-/ADU");
+		job.AddKey("RDNOISE", TFLOAT, detector_.readnoise,
+				"read noise used by weight, e-");
+		job.AddExt("WEIGHT", FLOAT_IMG, weight);
+	}
+	return writer_.Submit(job);
+}
+
+bool ADIProcess::CombineStack(int type, const float *stack, int nframe,
+		int cols, int rows, const float *scales, float *data, float *var,
+		float *ncomb) {
+	int w, h;
+	if (type < IMGTYP_ZERO || type > IMGTYP_FLAT || nframe < 3 || cols < 1
+			|| rows < 1 || (type == IMGTYP_DARK && !scales))
+		return false;
+	// 结果不替换标定图像, 因此不因尺寸变化释放已加载标定图像
+	if (MasterDimension(w, h) ? (w != cols || h != rows)
+			: !prepare_dimension(type, cols, rows))
+		return false;
+
+	band_ctx ctx;
+	size_t pixels(size_t(cols) * rows);
+	vector<float> norm(nframe, 1.0);
+	int i, nblock;
+
+	for (i = 0; type != IMGTYP_ZERO && i < nframe; ++i) {
+		// 平场缺省以抽样中值归一化, 与文件合并一致
+		if (scales)
+			norm[i] = scales[i];
+		else
+			norm[i] = normal_scale(const_cast<float*>(stack) + i * pixels,
+					int(pixels));
+		if (!(norm[i] > 0.0))
+			return false;
+	}
+	default_plan(ctx.plan);
+	ctx.type = type;
+	ctx.vec  = NULL;
+	ctx.row0 = 0;
+	ctx.row1 = rows;
+	ctx.data = data;
+	ctx.var  = var;
+	ctx.ncomb = ncomb;
+	ctx.nframe = nframe;
+	ctx.stack = stack;
+	ctx.scales = &norm[0];
+	ctx.zcoef = 0.0;
+	ctx.pixbuff = pool_.Alloc(ctx.plan.nthread * nframe);
+	nblock = (rows + ctx.plan.rows_block - 1) / ctx.plan.rows_block;
+	return parallel_for(nblock, ctx.plan.nthread,
+			boost::bind(&ADIProcess::combine_block, this, &ctx, _1, _2));
+}
+
+bool ADIProcess::MasterDimension(int &cols, int &rows) {
+	cols = info_.wdim;
+	rows = info_.hdim;
+	return info_.valid_zero || info_.valid_dark || info_.valid_flat;
+}
+
+bool ADIProcess::SetMaster(int type, const float *data, int cols, int rows,
+		const float *var) {
+	if (type < IMGTYP_ZERO || type > IMGTYP_FLAT || cols < 1 || rows < 1
+			|| !prepare_dimension(type, cols, rows))
+		return false;
+
+	fltarr &master = type == IMGTYP_ZERO ? zero_ :
+			(type == IMGTYP_DARK ? dark_ : flat_);
+	bool &valid = type == IMGTYP_ZERO ? info_.valid_zero :
+			(type == IMGTYP_DARK ? info_.valid_dark : info_.valid_flat);
+	int pixels(cols * rows);
+
+	master = pool_.Alloc(pixels);
+	memcpy(master.get(), data, pixels * sizeof(float));
+	ncomb_[type].reset();
+	zcoef_[type] = 0.0;
+	if (var) {
+		var_[type] = pool_.Alloc(pixels);
+		memcpy(var_[type].get(), var, pixels * sizeof(float));
+	}
+	else
+		var_[type].reset();
+	return (valid = true);
+}
+
+int ADIProcess::CalibrateFrame(float *data, int cols, int rows, float exptime,
+		float *weight) {
+	mem_plan plan;
+	if (!share_memory(resident_planes(), 0, 1, plan,
+			cosmic_.enable ? CosmicMask::Bytes(cols, rows) : 0))
+		return -1;
+	return calibrate_frame(data, cols, rows, exptime, weight, plan);
+}
+
+int ADIProcess::calibrate_frame(float *data, int cols, int rows,
+		float exptime, float *weight, const mem_plan &plan) {
+	CosmicMask mask;
+	int ncosmic(0);
+
+	if ((info_.valid_zero || info_.valid_dark || info_.valid_flat)
+			&& !info_.same_dimension(cols, rows))
+		return -1;
+	if (cosmic_.enable && (ncosmic = detect_cosmic(data, 0, 0, cols, rows,
+			exptime, mask, plan)) < 0)
+		return -1;
+	pre_process(data, 0, 0, cols, rows, exptime,
+			cosmic_.enable ? &mask : NULL, weight);
+	return ncosmic;
+}
+
+void ADIProcess::SetOutputMode(int mode) {
+	outmode_ = mode;
+}
+
+quant_stats ADIProcess::QuantStats() {
+	boost::mutex::scoped_lock lck(mtx_quant_);
+	return quant_;
+}
+
+pool_stats ADIProcess::PoolStats(bool reset) {
+	pool_stats stats = pool_.Stats();
+	if (reset)
+		pool_.ResetStats();
+	return stats;
+}
+
+void ADIProcess::SetScreen(int type, const param_screen &param) {
+	if (type >= IMGTYP_ZERO && type <= IMGTYP_FLAT)
+		screen_[type] = param;
+}
+
+void ADIProcess::SetFilter(const frame_filter &filter) {
+	filter_ = filter;
+	filter_.prefix.clear();
 }
 
 void ADIProcess::Reset(int type) {
@@ -206,28 +802,159 @@ void ADIProcess::Reset(int type) {
 		info_.valid_flat = false;
 		flat_.reset();
 	}
+	if (type >= IMGTYP_ZERO && type <= IMGTYP_FLAT) {
+		var_[type].reset();
+		ncomb_[type].reset();
+		zcoef_[type] = 0.0;
+	}
+}
+
+bool ADIProcess::load_master(int type, const string &filepath) {
+	FitsHandler fh;
+	fltarr &data = type == IMGTYP_DARK ? dark_ : flat_;
+	int rows, cols;
+
+	if (!fh.Open(filepath.c_str()))
+		return false;
+	fh.GetDimension(cols, rows);
+	if (rows * cols <= 0
+			|| ((info_.valid_zero || info_.valid_dark || info_.valid_flat)
+					&& !info_.same_dimension(cols, rows)))
+		return false;
+	data = pool_.Alloc(rows * cols);
+	if (!fh.LoadImage(data.get())) {
+		data.reset();
+		return false;
+	}
+	load_variance(fh, type);
+	info_.wdim = cols;
+	info_.hdim = rows;
+	return true;
+}
+
+void ADIProcess::load_variance(FitsHandler &fh, int type) {
+	int cols, rows, status(0);
+
+	fh.GetDimension(cols, rows);
+	var_[type] = pool_.Alloc(cols * rows);
+	ncomb_[type] = pool_.Alloc(cols * rows);
+	if (!fh.LoadExtension(EXT_VARIANCE, var_[type].get())
+			|| !fh.LoadExtension(EXT_NCOMB, ncomb_[type].get())) {
+		var_[type].reset();
+		ncomb_[type].reset();
+	}
+	// 早期文件无此关键字, 方差不含本底方差
+	zcoef_[type] = 0.0;
+	FitsLock lck;
+	if (var_[type])
+		fits_read_key(fh(), TFLOAT, "ZEROCOEF", &zcoef_[type], NULL, &status);
+	if (status)
+		zcoef_[type] = 0.0;
+}
+
+float ADIProcess::zero_coef(FitsNFPtrVec &vec) {
+	int n(vec.size());
+	if (!info_.valid_zero || !var_[IMGTYP_ZERO] || !n)
+		return 0.0;
+	double sum(0.0);
+	for (int i = 0; i < n; ++i)
+		sum += 1.0 / vec[i]->scale;
+	return float(sum / n);
+}
+
+bool ADIProcess::open_frame(FitsHPtr fhptr, const string &filepath) {
+	if (!fhptr->Open(filepath.c_str()))
+		return false;
+	fhptr->SetPool(&pool_);
+	if (overscan_.enable)
+		fhptr->SetOverscan(overscan_.trimsec, overscan_.biassec,
+				overscan_.smooth);
+	return true;
 }
 
 bool ADIProcess::scan_directory(const string &pathname, const string &prefix,
 		FitsNFPtrVec &vec) {
-	directory_iterator itend = directory_iterator();
-	string filename;
-	int rows1, cols1, rows2, cols2;
+	FrameIndex index;
+	frame_filter filter(filter_);
+	vector<string> filepaths;
 
-	// 遍历并打开文件
-	for (directory_iterator x = directory_iterator(pathname); x != itend; ++x) {
-		filename = x->path().filename().string();
-		if (filename.find(prefix))
+	// 依据文件头索引筛选文件, 仅打开符合条件的文件
+	filter.prefix = prefix;
+	if (!index.Load(pathname) || index.Select(filter, filepaths) < 3)
+		return false;
+	sort(filepaths.begin(), filepaths.end()); // 目录遍历顺序不确定
+	for (vector<string>::iterator it = filepaths.begin();
+			it != filepaths.end(); ++it) {
+		FitsNFPtr fnfptr = make_fits_info();
+		fnfptr->filepath = *it;
+		if (open_frame(fnfptr->hptr, *it))
+			vec.push_back(fnfptr);
+	}
+	return check_dimension(vec);
+}
+
+bool ADIProcess::scan_calibration(const param_calib &param,
+		FitsNFPtrVec vec[]) {
+	string dirs[] = { param.dir_zero, param.dir_dark, param.dir_flat };
+	string prefixes[] = { param.prefix_zero, param.prefix_dark,
+			param.prefix_flat };
+	FrameIndex index;
+	int type, i, j, k, n(0), rows, cols;
+
+	for (i = IMGTYP_ZERO; i <= IMGTYP_FLAT; ++i) {
+		if (dirs[i].empty())
+			continue;
+		// 相同目录仅扫描一次
+		for (j = IMGTYP_ZERO; j < i && dirs[j] != dirs[i]; ++j);
+		if (j < i || !index.Load(dirs[i]))
 			continue;
 
-		FitsNFPtr fnfptr = make_fits_info();
-		if (!fnfptr->hptr->Open(x->path().c_str()))
+		for (k = 0; k < index.Count(); ++k) {
+			const frame_info &info = index[k];
+			if (!index.Match(filter_, k))
+				continue;
+			// 按文件名前缀归类
+			for (type = IMGTYP_ZERO; type <= IMGTYP_FLAT; ++type) {
+				if (dirs[type] == dirs[i] && !prefixes[type].empty()
+						&& !info.filename.find(prefixes[type]))
+					break;
+			}
+			if (type > IMGTYP_FLAT) {// 按关键字IMAGETYP及曝光时间归类
+				if ((type = calib_type(info)) < 0 || dirs[type] != dirs[i]
+						|| !prefixes[type].empty())
+					continue;
+			}
+
+			FitsNFPtr fnfptr = make_fits_info();
+			fnfptr->filepath = index.FilePath(k);
+			if (open_frame(fnfptr->hptr, fnfptr->filepath))
+				vec[type].push_back(fnfptr);
+		}
+	}
+	// 各类型图像尺寸须一致
+	for (i = IMGTYP_ZERO; i <= IMGTYP_FLAT; ++i) {
+		if (!check_dimension(vec[i])) {
+			vec[i].clear();
 			continue;
-		vec.push_back(fnfptr);
+		}
+		vec[i][0]->hptr->GetDimension(cols, rows);
+		// 首个类型确定尺寸: 尺寸变化时释放已加载的标定图像, 暗场和平场须与
+		// 已加载本底一致
+		if ((!n && !prepare_dimension(i, cols, rows))
+				|| !info_.same_dimension(cols, rows)) {
+			vec[i].clear();
+			continue;
+		}
+		++n;
 	}
+	return n > 0;
+}
+
+bool ADIProcess::check_dimension(FitsNFPtrVec &vec) {
+	int rows1, cols1, rows2, cols2;
+
 	if (vec.size() < 3)
 		return false;
-	// 检查图像一致性
 	vec[0]->hptr->GetDimension(cols1, rows1);
 	for (FitsNFPtrVec::iterator it = vec.begin() + 1; it != vec.end();) {
 		(*it)->hptr->GetDimension(cols2, rows2);
@@ -239,20 +966,896 @@ bool ADIProcess::scan_directory(const string &pathname, const string &prefix,
 	return vec.size() >= 3;
 }
 
+bool ADIProcess::prepare_combine(int type, FitsNFPtrVec &vec) {
+	int rows, cols;
+
+	if (type == IMGTYP_DARK) {// 暗场以曝光时间归一化
+		for (FitsNFPtrVec::iterator it = vec.begin(); it != vec.end();) {
+			if (((*it)->scale = (*it)->hptr->GetExptime()) <= 0.0)
+				it = vec.erase(it);
+			else
+				++it;
+		}
+	}
+	if (vec.size() < 3)
+		return false;
+
+	vec[0]->hptr->GetDimension(cols, rows);
+	return prepare_dimension(type, cols, rows);
+}
+
+bool ADIProcess::prepare_dimension(int type, int cols, int rows) {
+	if (!info_.same_dimension(cols, rows)) {
+		if (type != IMGTYP_ZERO && info_.valid_zero) // 与本底尺寸不一致
+			return false;
+		// 尺寸变化后, 已有标定图像失效并释放
+		for (int i = IMGTYP_ZERO; i <= IMGTYP_FLAT; ++i)
+			Reset(i);
+		info_.wdim = cols;
+		info_.hdim = rows;
+	}
+	return true;
+}
+
+bool ADIProcess::combine_master(int type, FitsNFPtrVec &vec, mem_plan plan) {
+	if (!prepare_combine(type, vec))
+		return false;
+	fltarr &data = type == IMGTYP_ZERO ? zero_ :
+			(type == IMGTYP_DARK ? dark_ : flat_);
+	bool &valid = type == IMGTYP_ZERO ? info_.valid_zero :
+			(type == IMGTYP_DARK ? info_.valid_dark : info_.valid_flat);
+
+	// 先释放原有结果, 避免新旧结果同时驻留
+	Reset(type);
+	data = pool_.Alloc(info_.pixels()); // 处理结果
+	var_[type] = pool_.Alloc(info_.pixels());
+	ncomb_[type] = pool_.Alloc(info_.pixels());
+	if (!(valid = combine_band(type, vec, 0, info_.hdim, plan, data.get(),
+			var_[type].get(), ncomb_[type].get())))
+		return false;
+	if (type != IMGTYP_ZERO)
+		zcoef_[type] = zero_coef(vec);
+	return true;
+}
+
+bool ADIProcess::combine_band(int type, FitsNFPtrVec &vec, int row0, int row1,
+		mem_plan plan, float *data, float *var, float *ncomb) {
+	band_ctx ctx;
+	int nfile(vec.size()), cols(info_.wdim), nblock;
+	vector<float> scales(nfile);
+
+	// 叠加时另需单帧平移前数据缓存区
+	ctx.plan = plan;
+	if (!plan_memory(type == IMGTYP_OBJECT ? nfile + 1 : nfile, ctx.plan))
+		return false;
+	ctx.type = type;
+	ctx.vec  = &vec;
+	ctx.row0 = row0;
+	ctx.row1 = row1;
+	ctx.data = data;
+	ctx.var  = var;
+	ctx.ncomb = ncomb;
+	ctx.nframe = nfile;
+	ctx.stack = NULL;
+	for (int i = 0; i < nfile; ++i)
+		scales[i] = vec[i]->scale;
+	ctx.scales = &scales[0];
+	ctx.zcoef = type == IMGTYP_DARK || type == IMGTYP_FLAT
+			? zero_coef(vec) : 0.0;
+	// 各线程独立的缓存区
+	ctx.rowbuff = pool_.Alloc(
+			ctx.plan.nthread * nfile * cols * ctx.plan.rows_block);
+	ctx.pixbuff = pool_.Alloc(ctx.plan.nthread * nfile);
+	nblock = (row1 - row0 + ctx.plan.rows_block - 1) / ctx.plan.rows_block;
+
+	LoopFunc func;
+	if (type == IMGTYP_OBJECT) {
+		ctx.rawbuff = pool_.Alloc(
+				ctx.plan.nthread * (ctx.plan.rows_block + 1) * cols);
+		func = boost::bind(&ADIProcess::coadd_block, this, &ctx, _1, _2);
+	} else {
+		func = boost::bind(&ADIProcess::combine_block, this, &ctx, _1, _2);
+	}
+	return parallel_for(nblock, ctx.plan.nthread, func);
+}
+
+bool ADIProcess::combine_block(band_ctx *ctx, int iblock, int ithread) {
+	int type(ctx->type), cols(info_.wdim), nfile(ctx->nframe), ifile;
+	int row = ctx->row0 + iblock * ctx->plan.rows_block;
+	int nrow = min(ctx->plan.rows_block, ctx->row1 - row);
+	int pixels(nrow * cols), pos, off2;
+	size_t off1, stride(pixels);
+	const float *src, *scales(ctx->scales);
+	float *pixbuff = ctx->pixbuff.get() + ithread * nfile;
+	float *data = ctx->data + (row - ctx->row0) * cols;
+	float *var = ctx->var ? ctx->var + (row - ctx->row0) * cols : NULL;
+	float *ncomb = ctx->ncomb ? ctx->ncomb + (row - ctx->row0) * cols : NULL;
+	bool debias = type != IMGTYP_ZERO && info_.valid_zero;
+	float *vz = ctx->zcoef > 0.0 ? var_[IMGTYP_ZERO].get() : NULL;
+	float z2(ctx->zcoef * ctx->zcoef), bias(0.0), v;
+	int nkeep;
+
+	if (ctx->stack) {// 内存数据: 直接访问各帧对应行
+		src = ctx->stack + size_t(row) * cols;
+		stride = size_t(info_.wdim) * info_.hdim;
+	}
+	else {// 读出各文件分块数据. 文件句柄由各线程共享, 串行读取
+		FitsNFPtrVec &vec = *ctx->vec;
+		float *rowbuff = ctx->rowbuff.get()
+				+ ithread * nfile * cols * ctx->plan.rows_block;
+		boost::mutex::scoped_lock lck(ctx->mtx);
+		for (ifile = 0, off1 = 0; ifile < nfile; ++ifile, off1 += pixels) {
+			if (!vec[ifile]->hptr->LoadPixels(rowbuff + off1, pixels, row))
+				return false;
+		}
+		src = rowbuff;
+	}
+	// 合并分块各像素
+	for (pos = 0, off2 = row * cols; pos < pixels; ++pos, ++off2) {
+		// 加载各文件(col, row)位置数据. 暗场和平场减本底后归一化
+		if (type == IMGTYP_ZERO) {
+			for (ifile = 0, off1 = pos; ifile < nfile;
+					++ifile, off1 += stride) {
+				pixbuff[ifile] = src[off1];
+			}
+		} else {
+			if (debias)
+				bias = zero_[off2];
+			for (ifile = 0, off1 = pos; ifile < nfile;
+					++ifile, off1 += stride) {
+				pixbuff[ifile] = (src[off1] - bias) / scales[ifile];
+			}
+		}
+		// 方差与帧数随统计一并得到
+		if (!var)
+			data[pos] = type == IMGTYP_FLAT ? avsigclip(pixbuff, nfile)
+					: minmax_clip(pixbuff, nfile);
+		else {
+			data[pos] = type == IMGTYP_FLAT
+					? avsigclip(pixbuff, nfile, 3.0, 3.0, &v, &nkeep)
+					: minmax_clip(pixbuff, nfile, &v, &nkeep);
+			// 各帧共同的本底误差
+			var[pos] = vz ? v + z2 * vz[off2] : v;
+			if (ncomb)
+				ncomb[pos] = nkeep;
+		}
+	}
+	return true;
+}
+
+bool ADIProcess::coadd_block(band_ctx *ctx, int iblock, int ithread) {
+	FitsNFPtrVec &vec = *ctx->vec;
+	int cols(info_.wdim), rows(info_.hdim), nfile(vec.size()), ifile;
+	int row = ctx->row0 + iblock * ctx->plan.rows_block;
+	int nrow = min(ctx->plan.rows_block, ctx->row1 - row);
+	int pixels(nrow * cols), extra(coadd_.bilinear ? 1 : 0);
+	int pos, off, i, x, xa, xb, fx, fy, ra, rb, n;
+	float *stack = ctx->rowbuff.get()
+			+ ithread * nfile * cols * ctx->plan.rows_block;
+	float *raw = ctx->rawbuff.get()
+			+ ithread * (ctx->plan.rows_block + 1) * cols;
+	float *pixbuff = ctx->pixbuff.get() + ithread * nfile;
+	float *data = ctx->data + (row - ctx->row0) * cols;
+	float *out, *s0, *s1, wx, wy, w00, w01, w10, w11, v;
+	const float nan = numeric_limits<float>::quiet_NaN();
+	double sum;
+
+	for (ifile = 0; ifile < nfile; ++ifile) {
+		FitsInfo &info = *vec[ifile];
+		if (extra) {
+			fx = int(floor(info.dx));
+			fy = int(floor(info.dy));
+			wx = info.dx - fx;
+			wy = info.dy - fy;
+		} else {
+			fx = int(floor(info.dx + 0.5));
+			fy = int(floor(info.dy + 0.5));
+			wx = wy = 0.0;
+		}
+		w00 = (1.0 - wx) * (1.0 - wy);
+		w10 = wx * (1.0 - wy);
+		w01 = (1.0 - wx) * wy;
+		w11 = wx * wy;
+		// 读出并定标平移前的行[row + fy, row + fy + nrow + extra)
+		ra = max(row + fy, 0);
+		rb = min(row + fy + nrow + extra, rows);
+		if (ra < rb) {
+			{
+				boost::mutex::scoped_lock lck(ctx->mtx);
+				if (!info.hptr->LoadPixels(raw + (ra - row - fy) * cols,
+						(rb - ra) * cols, ra))
+					return false;
+			}
+			pre_process(raw + (ra - row - fy) * cols, 0, ra, cols, rb - ra,
+					info.exptime);
+		}
+		// 平移. 各像素插值权重相同
+		xa = max(0, -fx);
+		xb = min(cols, cols - fx - extra);
+		out = stack + ifile * pixels;
+		for (i = 0; i < nrow; ++i, out += cols) {
+			if (row + fy + i < ra || row + fy + i + extra >= rb || xa >= xb) {
+				fill(out, out + cols, nan);
+				continue;
+			}
+			s0 = raw + i * cols;
+			s1 = s0 + cols;
+			fill(out, out + xa, nan);
+			if (extra) {
+				for (x = xa; x < xb; ++x)
+					out[x] = w00 * s0[x + fx] + w10 * s0[x + fx + 1]
+							+ w01 * s1[x + fx] + w11 * s1[x + fx + 1];
+			} else {
+				for (x = xa; x < xb; ++x)
+					out[x] = s0[x + fx];
+			}
+			fill(out + xb, out + cols, nan);
+		}
+	}
+	// 逐像素合并覆盖该位置的帧
+	for (pos = 0; pos < pixels; ++pos) {
+		for (ifile = 0, n = 0, off = pos; ifile < nfile;
+				++ifile, off += pixels) {
+			v = stack[off];
+			if (v == v) // 剔除NaN
+				pixbuff[n++] = v;
+		}
+		if (n >= 5 && coadd_.sigclip)
+			data[pos] = avsigclip(pixbuff, n);
+		else if (n >= 3)
+			data[pos] = minmax_clip(pixbuff, n);
+		else if (n) {
+			for (i = 0, sum = 0.0; i < n; ++i)
+				sum += pixbuff[i];
+			data[pos] = sum / n;
+		} else
+			data[pos] = nan;
+	}
+	return true;
+}
+
+bool ADIProcess::estimate_offsets(FitsNFPtrVec &vec, mem_plan plan) {
+	offset_ctx ctx;
+	int cols(info_.wdim), rows(info_.hdim), maxdim(max(cols, rows));
+	size_t ref_bytes, frame_bytes, n;
+	fltarr img;
+
+	ctx.vec = &vec;
+	ctx.binning = coadd_.binning > 0 ? coadd_.binning : 1;
+	if (maxdim / ctx.binning > MAX_XCORR_SIZE)
+		ctx.binning = (maxdim + MAX_XCORR_SIZE - 1) / MAX_XCORR_SIZE;
+	ctx.bw = cols / ctx.binning;
+	ctx.bh = rows / ctx.binning;
+	if (ctx.bw < 8 || ctx.bh < 8)
+		return false;
+	ctx.nw = fft_size(ctx.bw);
+	ctx.nh = fft_size(ctx.bh);
+	for (ctx.wsize = REFINE_SIZE; ctx.wsize > cols || ctx.wsize > rows;
+			ctx.wsize >>= 1);
+	ctx.wx0 = (cols - ctx.wsize) / 2;
+	ctx.wy0 = (rows - ctx.wsize) / 2;
+	// 参考帧频谱常驻. 每帧另需图像、频谱及逐行读取缓存区
+	ref_bytes = size_t(ctx.nw * ctx.nh + ctx.wsize * ctx.wsize) * sizeof(cplx);
+	frame_bytes = size_t(max(ctx.bw * ctx.bh, ctx.wsize * ctx.wsize) + cols)
+			* sizeof(float)
+			+ size_t(max(ctx.nw * ctx.nh, ctx.wsize * ctx.wsize)) * sizeof(cplx);
+	if (plan.bytes) {
+		if (plan.bytes <= ref_bytes
+				|| (n = (plan.bytes - ref_bytes) / frame_bytes) < 1)
+			return false;
+		if (size_t(plan.nframe) > n)
+			plan.nframe = int(n);
+	}
+
+	// 参考帧频谱
+	FitsInfo &ref = *vec[0];
+	img = pool_.Alloc(max(ctx.bw * ctx.bh, ctx.wsize * ctx.wsize));
+	ctx.refspec = pool_.Alloc(ctx.nw * ctx.nh * CPLX_FLOATS);
+	ctx.winspec = pool_.Alloc(ctx.wsize * ctx.wsize * CPLX_FLOATS);
+	if (!load_binned(ref, ctx.binning, img.get()))
+		return false;
+	emphasize(img.get(), ctx.bw * ctx.bh);
+	make_spectrum(img.get(), ctx.bw, ctx.bh, ctx.nw, ctx.nh,
+			(cplx*) ctx.refspec.get());
+	if (!load_window(ref, ctx.wx0, ctx.wy0, ctx.wsize, img.get()))
+		return false;
+	emphasize(img.get(), ctx.wsize * ctx.wsize);
+	make_spectrum(img.get(), ctx.wsize, ctx.wsize, ctx.wsize, ctx.wsize,
+			(cplx*) ctx.winspec.get());
+	img.reset();
+	ref.dx = ref.dy = 0.0;
+
+	// 各帧偏移
+	parallel_for(vec.size(), plan.nframe,
+			boost::bind(&ADIProcess::offset_frame, this, &ctx, _1));
+	for (FitsNFPtrVec::iterator it = vec.begin(); it != vec.end();) {
+		if ((*it)->dx != (*it)->dx)
+			it = vec.erase(it);
+		else
+			++it;
+	}
+	return vec.size() >= 3;
+}
+
+bool ADIProcess::offset_frame(offset_ctx *ctx, int ifile) {
+	if (!ifile)
+		return true;
+	FitsInfo &info = *(*ctx->vec)[ifile];
+	int cols(info_.wdim), rows(info_.hdim), ws(ctx->wsize), x0, y0;
+	fltarr img = pool_.Alloc(max(ctx->bw * ctx->bh, ws * ws));
+	fltarr buff = pool_.Alloc(max(ctx->nw * ctx->nh, ws * ws) * CPLX_FLOATS);
+	cplx *spec = (cplx*) buff.get();
+	double dx, dy, rx, ry;
+
+	info.dx = info.dy = numeric_limits<float>::quiet_NaN();
+	// 降采样图像估计粗偏移
+	if (!load_binned(info, ctx->binning, img.get()))
+		return true;
+	emphasize(img.get(), ctx->bw * ctx->bh);
+	make_spectrum(img.get(), ctx->bw, ctx->bh, ctx->nw, ctx->nh, spec);
+	if (xcorr_peak((cplx*) ctx->refspec.get(), spec, ctx->nw, ctx->nh, dx, dy)
+			<= 0.0)
+		return true;
+	dx *= ctx->binning;
+	dy *= ctx->binning;
+	// 全分辨率窗口精化偏移
+	x0 = ctx->wx0 + int(floor(dx + 0.5));
+	y0 = ctx->wy0 + int(floor(dy + 0.5));
+	x0 = x0 < 0 ? 0 : (x0 > cols - ws ? cols - ws : x0);
+	y0 = y0 < 0 ? 0 : (y0 > rows - ws ? rows - ws : y0);
+	if (load_window(info, x0, y0, ws, img.get())) {
+		emphasize(img.get(), ws * ws);
+		make_spectrum(img.get(), ws, ws, ws, ws, spec);
+		if (xcorr_peak((cplx*) ctx->winspec.get(), spec, ws, ws, rx, ry) > 0.0
+				&& fabs(rx) < ws / 4 && fabs(ry) < ws / 4) {
+			dx = x0 - ctx->wx0 + rx;
+			dy = y0 - ctx->wy0 + ry;
+		}
+	}
+	info.dx = dx;
+	info.dy = dy;
+	return true;
+}
+
+bool ADIProcess::load_binned(FitsInfo &info, int binning, float *img) {
+	int cols(info_.wdim), rows(info_.hdim);
+	int bw(cols / binning), bh(rows / binning), i, j;
+	fltarr buff = pool_.Alloc(cols);
+	float *row = buff.get(), *dst;
+	float norm = 1.0 / (binning * binning);
+
+	fill(img, img + bw * bh, 0.0f);
+	for (j = 0; j < bh * binning; ++j) {
+		if (!info.hptr->LoadPixels(row, cols, j))
+			return false;
+		pre_process(row, 0, j, cols, 1, info.exptime);
+		dst = img + (j / binning) * bw;
+		for (i = 0; i < bw * binning; ++i)
+			dst[i / binning] += row[i];
+	}
+	for (i = 0; i < bw * bh; ++i)
+		img[i] *= norm;
+	return true;
+}
+
+bool ADIProcess::load_window(FitsInfo &info, int x0, int y0, int size,
+		float *img) {
+	for (int j = 0; j < size; ++j) {
+		if (!info.hptr->LoadPixels(img + j * size, size, y0 + j, x0))
+			return false;
+	}
+	pre_process(img, x0, y0, size, size, info.exptime);
+	return true;
+}
+
+void ADIProcess::emphasize(float *img, int n) {
+	float median = normal_scale(img, n), v;
+	for (int i = 0; i < n; ++i) {
+		v = img[i] - median;
+		img[i] = v > 0.0 ? v : 0.0;
+	}
+}
+
+bool ADIProcess::normal_scales(FitsNFPtrVec &vec, mem_plan plan) {
+	if (vec.size() < 3 || !plan_memory(vec.size(), plan))
+		return false;
+	// 统计归一化比例尺
+	parallel_for(vec.size(), plan.nframe,
+			boost::bind(&ADIProcess::scale_frame, this, &vec, &plan, _1));
+	for (FitsNFPtrVec::iterator it = vec.begin(); it != vec.end();) {
+		if ((*it)->scale <= 0.0)
+			it = vec.erase(it);
+		else
+			++it;
+	}
+	return vec.size() >= 3;
+}
+
+bool ADIProcess::scale_frame(FitsNFPtrVec *vec, const mem_plan *plan,
+		int ifile) {
+	FitsHPtr fhptr = (*vec)[ifile]->hptr;
+	if ((*vec)[ifile]->scale <= 0.0) // 筛选时已由抽样中值确定
+		(*vec)[ifile]->scale = plan->incore ? normal_scale(fhptr)
+				: normal_scale(fhptr, SAMPLE_ROWS);
+	return true;
+}
+
+bool ADIProcess::screen_frames(int type, FitsNFPtrVec &vec, mem_plan plan) {
+	param_screen &param = screen_[type];
+
+	if (!param.enable)
+		return vec.size() >= 3;
+	if (vec.size() < 3 || !plan_memory(vec.size(), plan))
+		return false;
+	parallel_for(vec.size(), plan.nframe,
+			boost::bind(&ADIProcess::screen_frame, this, type, &vec, _1));
+	// 剔除统计失败或超出限制的文件
+	for (FitsNFPtrVec::iterator it = vec.begin(); it != vec.end();) {
+		FitsInfo &info = **it;
+		if (info.rms < 0.0
+				|| (param.median_max >= param.median_min
+						&& (info.median < param.median_min
+								|| info.median > param.median_max))
+				|| (param.rms_max > 0.0 && info.rms > param.rms_max)
+				|| (param.saturation > 0.0 && info.satfrac > param.satfrac_max))
+			it = vec.erase(it);
+		else
+			++it;
+	}
+	return vec.size() >= 3;
+}
+
+bool ADIProcess::screen_frame(int type, FitsNFPtrVec *vec, int ifile) {
+	FitsInfo &info = *(*vec)[ifile];
+	float saturation = screen_[type].saturation;
+	fltarr tmp;
+	float *x;
+	int n, i, nsat(0), half;
+
+	if (!(n = sample_pixels(info.hptr, SAMPLE_ROWS, tmp))) {
+		info.rms = -1.0;
+		return true;
+	}
+	x = tmp.get();
+	half = n / 2;
+	if (saturation > 0.0) {
+		for (i = 0; i < n; ++i) {
+			if (x[i] >= saturation)
+				++nsat;
+		}
+	}
+	nth_element(x, x + half, x + n);
+	info.median = x[half];
+	info.satfrac = float(nsat) / n;
+	// 噪声: 1.4826 * 中值绝对偏差, 不受恒星和宇宙线影响
+	for (i = 0; i < n; ++i)
+		x[i] = fabs(x[i] - info.median);
+	nth_element(x, x + half, x + n);
+	info.rms = 1.4826 * x[half];
+	// 平场以抽样中值作为归一化比例尺, 不再重复读取
+	if (type == IMGTYP_FLAT)
+		info.scale = info.median;
+	return true;
+}
+
+int ADIProcess::resident_planes() {
+	fltarr *master[] = { &zero_, &dark_, &flat_ };
+	int n(0);
+
+	for (int type = IMGTYP_ZERO; type <= IMGTYP_FLAT; ++type) {
+		if (*master[type])
+			++n;
+		if (var_[type])
+			++n;
+		if (ncomb_[type])
+			++n;
+	}
+	return n;
+}
+
+size_t ADIProcess::writer_bytes(size_t job_bytes) {
+	// 队列满时提交阻塞, 另有一个任务写入中
+	return (writer_.Capacity() + 1) * job_bytes
+			+ (2 * SAMPLE_PIXELS + QUANT_BLOCK / 2) * sizeof(float);
+}
+
+size_t ADIProcess::level_bytes(size_t nhandle, int rows) {
+	// 过扫区改正时各文件句柄缓存逐行电平
+	return overscan_.enable ? nhandle * rows * sizeof(float) : 0;
+}
+
+bool ADIProcess::share_memory(int nplane, size_t extra, int ntask,
+		mem_plan &plan, size_t fixed) {
+	size_t resident = size_t(nplane) * info_.pixels() * sizeof(float) + extra
+			+ fixed;
+
+	default_plan(plan);
+	plan.bytes = 0;
+	if (!mem_budget_)
+		return true;
+	if (resident >= mem_budget_)
+		return false;
+	// 池外内存占用的预算不再由池申请
+	pool_.SetLimit(mem_budget_ - fixed);
+	plan.bytes = (mem_budget_ - resident) / (ntask > 1 ? ntask : 1);
+	return true;
+}
+
+void ADIProcess::default_plan(mem_plan &plan) {
+	int rows(info_.hdim);
+	int hw = boost::thread::hardware_concurrency();
+
+	if (hw < 1)
+		hw = 1;
+	// 每个线程至少处理4个分块
+	plan.nthread = hw;
+	plan.rows_block = (rows + 4 * hw - 1) / (4 * hw);
+	if (plan.rows_block > MAX_ROWS_BLOCK)
+		plan.rows_block = MAX_ROWS_BLOCK;
+	if (plan.rows_block < 1)
+		plan.rows_block = 1;
+	plan.nframe = hw;
+	plan.incore = true;
+}
+
+bool ADIProcess::plan_memory(int nfile, mem_plan &plan) {
+	size_t cols(info_.wdim), rows(info_.hdim);
+	// 载入整帧, 另有抽样缓存区
+	size_t frame_bytes = (cols * rows + SAMPLE_PIXELS + 1) * sizeof(float);
+	// 逐行抽样: 行缓存区及样本
+	size_t sample_bytes = (cols + SAMPLE_PIXELS + SAMPLE_ROWS) * sizeof(float);
+	size_t thread_bytes, n;
+
+	default_plan(plan);
+	if (!plan.bytes)
+		return true;
+
+	// 合并: 每个线程缓存rows_block行数据
+	if ((n = plan.bytes / ((cols + 1) * nfile * sizeof(float))) < 1)
+		return false;
+	if (size_t(plan.nthread) > n)
+		plan.nthread = int(n);
+	thread_bytes = plan.bytes / plan.nthread;
+	n = (thread_bytes / (nfile * sizeof(float)) - 1) / cols;
+	if (size_t(plan.rows_block) > n)
+		plan.rows_block = int(n);
+	// 统计: 内存允许时载入整帧, 否则逐行抽样
+	if ((n = plan.bytes / frame_bytes) < 1) {
+		plan.incore = false;
+		if ((n = plan.bytes / sample_bytes) < 1)
+			return false;
+	}
+	if (size_t(plan.nframe) > n)
+		plan.nframe = int(n);
+	return true;
+}
+
+bool ADIProcess::plan_cosmic(int tile, mem_plan &plan) {
+	size_t thread_bytes = cosmic_thread_floats(tile) * sizeof(float), n;
+
+	default_plan(plan);
+	if (!plan.bytes)
+		return true;
+	if ((n = plan.bytes / thread_bytes) < 1)
+		return false;
+	if (size_t(plan.nthread) > n)
+		plan.nthread = int(n);
+	return true;
+}
+
+string ADIProcess::shard_filepath(int type, const string &pathname,
+		int ishard, int nshard) {
+	char filename[40];
+	path filepath = pathname;
+
+	sprintf(filename, "%s.part%03dof%03d", master_name[type], ishard, nshard);
+	filepath /= path(filename);
+	return filepath.string();
+}
+
+string ADIProcess::shard_planpath(int type, const string &pathname) {
+	path filepath = pathname;
+	filepath /= path(string(master_name[type]) + ".plan");
+	return filepath.string();
+}
+
+bool ADIProcess::select_shard(int type, const string &pathname,
+		const string &prefix, FitsNFPtrVec &vec) {
+	mem_plan plan;
+	return scan_directory(pathname, prefix, vec) && prepare_combine(type, vec)
+			&& share_memory(resident_planes(), level_bytes(vec.size(),
+					info_.hdim), 1, plan, vec.size() * FITS_HANDLE_BYTES)
+			&& screen_frames(type, vec, plan)
+			&& (type != IMGTYP_FLAT || normal_scales(vec, plan));
+}
+
+bool ADIProcess::save_shard_plan(int type, const string &pathname,
+		const string &prefix, const string &output, FitsNFPtrVec &vec) {
+	string filepath = shard_planpath(type, output);
+	char suffix[40];
+	sprintf(suffix, ".%d.tmp", int(getpid()));
+	string tmppath = filepath + suffix;
+	FILE *fp = fopen(tmppath.c_str(), "w");
+	if (!fp)
+		return false;
+
+	fprintf(fp, "%s\n%s\t%s\n", SHARD_PLAN_MAGIC, pathname.c_str(),
+			prefix.c_str());
+	for (FitsNFPtrVec::iterator it = vec.begin(); it != vec.end(); ++it)
+		fprintf(fp, "%s\t%.9g\n", (*it)->filepath.c_str(), (*it)->scale);
+	boost::system::error_code ec;
+	if (fclose(fp)) {
+		remove(tmppath, ec);
+		return false;
+	}
+	rename(tmppath, filepath, ec);
+	return !ec;
+}
+
+bool ADIProcess::load_shard_plan(int type, const string &pathname,
+		const string &prefix, const string &output, FitsNFPtrVec &vec) {
+	std::ifstream in(shard_planpath(type, output).c_str());
+	string line;
+	vector<string> tokens;
+	int cols, rows;
+
+	if (!in.good() || !getline(in, line) || line != SHARD_PLAN_MAGIC
+			|| !getline(in, line) || line != pathname + "\t" + prefix)
+		return false;
+	while (getline(in, line)) {
+		boost::split(tokens, line, boost::is_any_of("\t"));
+		if (tokens.size() != 2)
+			continue;
+		FitsNFPtr fnfptr = make_fits_info();
+		fnfptr->filepath = tokens[0];
+		fnfptr->scale = float(atof(tokens[1].c_str()));
+		if (!open_frame(fnfptr->hptr, fnfptr->filepath)) {
+			vec.clear();
+			return false;
+		}
+		vec.push_back(fnfptr);
+	}
+	if (!check_dimension(vec))
+		return false;
+	vec[0]->hptr->GetDimension(cols, rows);
+	return prepare_dimension(type, cols, rows);
+}
+
+bool ADIProcess::write_master(int type, const string &filepath) {
+	out_job job;
+	if (type == IMGTYP_ZERO)
+		job.data = zero_;
+	else if (type == IMGTYP_DARK)
+		job.data = dark_;
+	else
+		job.data = flat_;
+	if (!job.data)
+		return false;
+
+	job.filepath = filepath;
+	job.cols = info_.wdim;
+	job.rows = info_.hdim;
+	job.mode = outmode_;
+	job.AddKey("DATE-OBS", boost::posix_time::to_iso_extended_string(
+			second_clock::universal_time()), "time of file genernated");
+	if (type != IMGTYP_ZERO)
+		job.AddKey("EXPTIME", TFLOAT, 1.0, "Exposure duration");
+	if (var_[type] && ncomb_[type]) {
+		if (type != IMGTYP_ZERO)
+			job.AddKey("ZEROCOEF", TFLOAT, zcoef_[type],
+					"variance includes ZEROCOEF^2 * ZERO variance");
+		job.AddExt(EXT_VARIANCE, FLOAT_IMG, var_[type]);
+		job.AddExt(EXT_NCOMB, SHORT_IMG, ncomb_[type]);
+	}
+	return writer_.Submit(job);
+}
+
+bool ADIProcess::write_job(const out_job &job) {
+	FitsLock lck;
+	// 临时文件名含进程号, 避免多进程写入同一文件时冲突
+	char suffix[40];
+	sprintf(suffix, ".%d.tmp", int(getpid()));
+	string tmppath = job.filepath + suffix;
+	float *var(NULL);
+	for (vector<out_ext>::const_iterator it = job.exts.begin();
+			it != job.exts.end(); ++it) {
+		if (it->extname == EXT_VARIANCE)
+			var = it->data.get();
+	}
+	FitsHPtr fhptr = output_image(job.data.get(), job.cols, job.rows, tmppath,
+			job.mode, var);
+	boost::system::error_code ec;
+	int status(0), ival;
+	float fval;
+	double dval;
+
+	if (!fhptr.unique()) {
+		remove(tmppath, ec);
+		return false;
+	}
+	for (vector<string>::const_iterator it = job.cards.begin();
+			it != job.cards.end() && !status; ++it)
+		fits_write_record((*fhptr)(), it->c_str(), &status);
+	for (vector<out_key>::const_iterator it = job.keys.begin();
+			it != job.keys.end() && !status; ++it) {
+		const char *keyword = it->keyword.c_str();
+		const char *comment = it->comment.c_str();
+		if (it->datatype == TINT) {
+			ival = int(it->value);
+			fits_update_key((*fhptr)(), TINT, keyword, &ival, comment,
+					&status);
+		} else if (it->datatype == TFLOAT) {
+			fval = float(it->value);
+			fits_update_key((*fhptr)(), TFLOAT, keyword, &fval, comment,
+					&status);
+		} else if (it->datatype == TDOUBLE) {
+			dval = it->value;
+			fits_update_key((*fhptr)(), TDOUBLE, keyword, &dval, comment,
+					&status);
+		} else {
+			fits_update_key((*fhptr)(), TSTRING, keyword,
+					(void*) it->text.c_str(), comment, &status);
+		}
+	}
+	// 图像扩展
+	for (vector<out_ext>::const_iterator it = job.exts.begin();
+			it != job.exts.end() && !status; ++it) {
+		if (!fhptr->AppendImage(it->extname.c_str(), it->bitpix)
+				|| !fhptr->WriteImage(it->data.get(), TFLOAT))
+			status = -1;
+	}
+	// 关闭并更名. 读取方不会看到未写完的文件
+	if (!fhptr->Close() || status) {
+		remove(tmppath, ec);
+		return false;
+	}
+	rename(tmppath, job.filepath, ec);
+	if (ec) {
+		boost::system::error_code ec1;
+		remove(tmppath, ec1);
+	}
+	return !ec;
+}
+
 FitsHPtr ADIProcess::output_image(float *data, int cols, int rows,
-		const string &pathname) {
+		const string &pathname, int mode, float *var) {
 	FitsHPtr fhptr = make_fits_handler();
 	FitsHPtr fhret;
+	quant_info qi;
 
-	if (exists(pathname))
-		remove(pathname);
-	if (fhptr->CreateImage(pathname.c_str(), FLOAT_IMG, cols, rows)
-			&& fhptr->WriteImage(data, TFLOAT)) {
+	boost::system::error_code ec;
+	// 在写入线程中执行, 不抛出异常
+	if (exists(pathname, ec))
+		remove(pathname, ec);
+	qi.mode = mode;
+	if (mode != OUTPUT_FLOAT)
+		plan_quantize(data, cols * rows, qi, var);
+	if (qi.mode == OUTPUT_FLOAT) {
+		if (fhptr->CreateImage(pathname.c_str(), FLOAT_IMG, cols, rows)
+				&& fhptr->WriteImage(data, TFLOAT)) {
+			fhret = fhptr;
+		}
+	} else if (fhptr->CreateImage(pathname.c_str(), SHORT_IMG, cols, rows)
+			&& write_quantized(fhptr, data, cols * rows, qi)) {
 		fhret = fhptr;
 	}
+
+	if (mode != OUTPUT_FLOAT) {
+		boost::mutex::scoped_lock lck(mtx_quant_);
+		if (qi.mode == OUTPUT_FLOAT)
+			++quant_.nfloat;
+		else {
+			float ratio = qi.noise > 0.0 ? qi.qerr / qi.noise : 0.0;
+			++quant_.nframe;
+			if (ratio > quant_.ratio_max)
+				quant_.ratio_max = ratio;
+		}
+	}
 	return fhret;
 }
 
+void ADIProcess::plan_quantize(float *data, int n, quant_info &qi,
+		float *var) {
+	int ns = n > SAMPLE_PIXELS ? SAMPLE_PIXELS : n;
+	int i, m(0), half;
+	float step = float(n) / ns, pos(0.0);
+	float x, vmin(1E30), vmax(-1E30);
+	fltarr buff = pool_.Alloc(2 * ns);
+	float *smp = buff.get(), *dev = smp + ns;
+
+	// 数据范围. 剔除nan/inf
+	for (i = 0; i < n; ++i) {
+		x = data[i];
+		if (x - x == 0.0f) {
+			vmin = x < vmin ? x : vmin;
+			vmax = x > vmax ? x : vmax;
+		}
+	}
+	if (vmin > vmax)
+		vmin = vmax = 0.0;
+	qi.bzero = 0.5 * (vmin + vmax);
+	qi.bscale = vmax > vmin ? (vmax - vmin) / 65534 : 1.0;
+
+	// 等间距抽样, 估计噪声和量化误差
+	for (i = 0; i < ns; ++i, pos += step) {
+		x = data[int(pos)];
+		if (x - x == 0.0f)
+			smp[m++] = x;
+	}
+	qi.noise = qi.qerr = 0.0;
+	if (m) {
+		half = m / 2;
+		nth_element(smp, smp + half, smp + m);
+		for (i = 0; i < m; ++i)
+			dev[i] = fabs(smp[i] - smp[half]);
+		nth_element(dev, dev + half, dev + m);
+		qi.noise = 1.4826 * dev[half];
+	}
+	if (var) {
+		for (i = 0, m = 0, pos = 0.0; i < ns; ++i, pos += step) {
+			x = var[int(pos)];
+			if (x - x == 0.0f && x > 0.0f)
+				smp[m++] = x;
+		}
+		if (m) {
+			nth_element(smp, smp + m / 2, smp + m);
+			qi.noise = sqrt(smp[m / 2]);
+		}
+	}
+	qi.qerr = qi.bscale / sqrt(12.0);
+
+	// 量化误差超限时改为32位输出
+	if (qi.qerr > QUANT_NOISE_RATIO * qi.noise)
+		qi.mode = OUTPUT_FLOAT;
+}
+
+bool ADIProcess::write_quantized(FitsHPtr fhptr, float *data, int n,
+		quant_info &qi) {
+	fitsfile *fitsptr = (*fhptr)();
+	fltarr buff = pool_.Alloc(QUANT_BLOCK / 2);
+	short *q = (short*) buff.get();
+	float *x;
+	float bs(qi.bscale), bz(qi.bzero), inv(1.0 / qi.bscale), v, d;
+	double err(0.0), bscale(bs), bzero(bz);
+	int status(0), blank(QUANT_BLANK);
+	int i, k, m, nvalid(0);
+
+	fits_write_key(fitsptr, TDOUBLE, "BSCALE", &bscale,
+			"physical = BZERO + BSCALE * array", &status);
+	fits_write_key(fitsptr, TDOUBLE, "BZERO", &bzero,
+			"physical = BZERO + BSCALE * array", &status);
+	fits_write_key(fitsptr, TINT, "BLANK", &blank, "undefined pixel",
+			&status);
+	// 写入量化后的原始整数
+	fits_set_hdustruc(fitsptr, &status);
+	fits_set_bscale(fitsptr, 1.0, 0.0, &status);
+
+	for (k = 0; k < n && !status; k += m) {
+		m = n - k > QUANT_BLOCK ? QUANT_BLOCK : n - k;
+		x = data + k;
+		for (i = 0; i < m; ++i) {
+			if (x[i] - x[i] != 0.0f) {
+				q[i] = QUANT_BLANK;
+				continue;
+			}
+			v = floorf((x[i] - bz) * inv + 0.5f);
+			v = v > 32767.0f ? 32767.0f : (v < -32767.0f ? -32767.0f : v);
+			q[i] = short(v);
+			d = x[i] - (v * bs + bz);
+			err += d * d;
+			++nvalid;
+		}
+		fits_write_img(fitsptr, TSHORT, k + 1, m, q, &status);
+	}
+	qi.qerr = nvalid ? sqrt(err / nvalid) : 0.0;
+	fits_write_key(fitsptr, TFLOAT, "QERR", &qi.qerr,
+			"quantization error rms", &status);
+	fits_write_key(fitsptr, TFLOAT, "QNOISE", &qi.noise,
+			"sampled noise rms", &status);
+
+	return status == 0;
+}
+
 /*
  * 基于样本中值, 对图像数据做归一化处理
  */
@@ -261,55 +1864,146 @@ float ADIProcess::normal_scale(FitsHPtr fhptr) {
 	fltarr data;
 	fhptr->GetDimension(cols, rows);
 	pixels = rows * cols;
-	data.reset(new float[pixels]);
+	data = pool_.Alloc(pixels);
 	fhptr->LoadImage(data.get());
 	return normal_scale(data.get(), pixels);
 }
 
 float ADIProcess::normal_scale(float *data, int n) {
-	int ns = n > 10000 ? 10000 : n;
+	int ns = n > SAMPLE_PIXELS ? SAMPLE_PIXELS : n;
 	int off = ns == n ? 0 : (n % ns) / 2;
 	int i;
-	float scale, pos(0.0);
+	float pos(0.0);
 	float step = ns == n ? 1.0 : float((n * 1.0 / ns));
-	vector<float> tmp;
+	fltarr buff = pool_.Alloc(ns + 1);
+	float *tmp = buff.get();
 
-	for (i = 0; off < n; ++i) {
-		tmp.push_back(data[off]);
+	for (i = 0; off < n && i <= ns; ++i) {
+		tmp[i] = data[off];
 		pos += step;
 		off = int(pos);
 	}
-	nth_element(tmp.begin(), tmp.begin() + ns / 2, tmp.end());
-	scale = tmp[ns / 2];
-	tmp.clear();
-	return scale;
+	if (!(i = pack_finite(tmp, i)))
+		return -1.0;
+	nth_element(tmp, tmp + i / 2, tmp + i);
+	return tmp[i / 2];
+}
+
+int ADIProcess::sample_pixels(FitsHPtr fhptr, int nrow, fltarr &samples) {
+	int rows, cols, row, col, i, j, ns, n(0);
+	fltarr data;
+
+	fhptr->GetDimension(cols, rows);
+	if (nrow > rows)
+		nrow = rows;
+	if (nrow < 1)
+		return 0;
+	if ((ns = SAMPLE_PIXELS / nrow + 1) > cols)
+		ns = cols;
+	data = pool_.Alloc(cols);
+	samples = pool_.Alloc(nrow * ns);
+	// 等间距抽样行, 各行内等间距抽样像素
+	for (i = 0; i < nrow; ++i) {
+		row = int((i + 0.5) * rows / nrow);
+		if (!fhptr->LoadPixels(data.get(), cols, row))
+			return 0;
+		for (j = 0; j < ns; ++j) {
+			col = int((j + 0.5) * cols / ns);
+			samples[n] = data[col];
+			if (samples[n] - samples[n] == 0.0) // 剔除NaN和Inf
+				++n;
+		}
+	}
+	return n;
+}
+
+float ADIProcess::normal_scale(FitsHPtr fhptr, int nrow) {
+	fltarr tmp;
+	float *x;
+	int n;
+
+	if (!(n = sample_pixels(fhptr, nrow, tmp)))
+		return -1.0;
+	x = tmp.get();
+	nth_element(x, x + n / 2, x + n);
+	return x[n / 2];
 }
 
 void ADIProcess::conv_filter(float *x, int w, int h) {
 	int whalf(w / 2), hhalf(h / 2);
 }
 
-float ADIProcess::minmax_clip(float *x, int n) {
-	if (n < 3)
-		return 0.0;
+int ADIProcess::pack_finite(float *x, int n) {
+	int i, k;
+	float t;
 
+	for (i = k = 0; i < n; ++i) {
+		t = x[i];
+		if (t - t == 0.0) // NaN和Inf相减均为NaN
+			x[k++] = t;
+	}
+	return k;
+}
+
+float ADIProcess::minmax_clip(float *x, int n, float *var, int *nkeep) {
 	float min(1E30), max(-1E30);
-	double sum;
+	double sum(0.0), sq(0.0);
+
+	n = pack_finite(x, n);
+	if (n < 3) {// 不足以剔除极值: 取均值
+		for (int i = 0; i < n; ++i) {
+			sum += x[i];
+			sq += double(x[i]) * x[i];
+		}
+		if (var)
+			*var = n ? clip_variance(sum, sq, n)
+					: numeric_limits<float>::quiet_NaN();
+		if (nkeep)
+			*nkeep = n;
+		return n ? float(sum / n) : numeric_limits<float>::quiet_NaN();
+	}
 	for (int i = 0; i < n; ++i) {
 		if (x[i] < min)
 			min = x[i];
 		if (x[i] > max)
 			max = x[i];
 		sum += x[i];
+		sq += double(x[i]) * x[i];
 	}
+	if (n == 3) {// 剔除后仅余一个: 即中值, 以全部数据估计中值的方差
+		if (var) {
+			double s2 = (sq - sum * sum / n) / (n - 1);
+			*var = s2 > 0.0 ? float(M_PI_2 * s2 / n) : 0.0;
+		}
+		if (nkeep)
+			*nkeep = n;
+		return sum - min - max;
+	}
+	if (var)
+		*var = clip_variance(sum - min - max,
+				sq - double(min) * min - double(max) * max, n - 2);
+	if (nkeep)
+		*nkeep = n - 2;
 	return (sum - min - max) / (n - 2);
 }
 
-float ADIProcess::avsigclip(float *x, int n, float lsigma, float hsigma) {
+float ADIProcess::clip_variance(double sum, double sq, int k) {
+	if (k < 2)
+		return 0.0;
+	double mean = sum / k;
+	double s2 = (sq - k * mean * mean) / (k - 1);
+	return s2 > 0.0 ? float(s2 / k) : 0.0;
+}
+
+float ADIProcess::avsigclip(float *x, int n, float lsigma, float hsigma,
+		float *var, int *nkeep) {
 	double sum, sq;
 	float min(1E30), max(-1E30), mean, rms, low, high, t;
 	int i, n1, n2;
 
+	// 首轮统计需剔除极值后至少两个数据
+	if ((n = pack_finite(x, n)) <= 3)
+		return minmax_clip(x, n, var, nkeep);
 	sum = sq = 0.0;
 	for (i = 0; i < n; ++i) {
 		sum += (t = x[i]);
@@ -343,18 +2037,31 @@ float ADIProcess::avsigclip(float *x, int n, float lsigma, float hsigma) {
 			}
 		}
 	} while (n2 > 3 && n1 > n2);
-	return n2 > 3 ? ((sum - min - max) / (n2 - 2)) : mean;
+	if (n2 > 3) {
+		if (var)
+			*var = clip_variance(sum - min - max,
+					sq - double(min) * min - double(max) * max, n2 - 2);
+		if (nkeep)
+			*nkeep = n2 - 2;
+		return (sum - min - max) / (n2 - 2);
+	}
+	// 剩余样本不足时沿用上一轮统计. 舍入误差可使rms为nan
+	if (var)
+		*var = rms > 0.0 ? rms * rms / (n1 - 2) : 0.0;
+	if (nkeep)
+		*nkeep = n1 - 2;
+	return mean;
 }
 
 void ADIProcess::remove_noise(float *x, int cols, int rows) {
-	int pixels = cols * rows, i;
+	int pixels = cols * rows, i, k, r;
 	int row, col;
 	float median, mean, rms, low, high, min(1E30), max(-1E30), t;
 	double sum(0.0), sq(0.0);
 	fltarr tmp;
-	// 备份原始数据
-	tmp.reset(new float[pixels]);
-	memcpy(tmp.get(), x, pixels * sizeof(float));
+	float *near[5];
+	// 备份原始数据: 仅保留当前行及之前两行, 之后两行尚未修改
+	tmp = pool_.Alloc(3 * cols);
 	// 统计
 	median = normal_scale(x, pixels);
 	for (i = 0; i < pixels; ++i) {
@@ -373,43 +2080,48 @@ void ADIProcess::remove_noise(float *x, int cols, int rows) {
 	high = median + 3.0 * rms;
 	// 遍历剔除噪声
 	for (row = i = 0; row < rows; ++row) {
+		memcpy(tmp.get() + (row % 3) * cols, x + row * cols,
+				cols * sizeof(float));
+		for (k = 0; k < 5; ++k) {
+			r = row + k - 2;
+			if (r < 0 || r >= rows)
+				near[k] = NULL;
+			else if (k <= 2)
+				near[k] = tmp.get() + (r % 3) * cols;
+			else
+				near[k] = x + r * cols;
+		}
 		for (col = 0; col < cols; ++col, ++i) {
 			if (low > (t = x[i]) || high < t) {
-				x[i] = av_replace(tmp.get(), col, row, cols, rows);
+				x[i] = av_replace(near, col, cols);
 			}
 		}
 	}
 }
 
-float ADIProcess::av_replace(float *x, int col, int row, int cols, int rows) {
+float ADIProcess::av_replace(float *x[], int col, int cols) {
 	int w(2);
-	int r1 = row - w;
-	int r2 = row + w;
 	int c1 = col - w;
 	int c2 = col + w;
-	int n, r, c, d, offset;
-	float min(1E30), max(-1E30), pix = x[row * cols + col], t;
+	int n(0), r, c;
+	float min(1E30), max(-1E30), pix = x[w][col], t;
 	double sum(0.0);
 
-	if (r1 < 0)
-		r1 = 0;
-	if (r2 >= rows)
-		r2 = rows - 1;
 	if (c1 < 0)
 		c1 = 0;
 	if (c2 >= cols)
 		c2 = cols - 1;
 
-	n = (r2 - r1 + 1) * (d = c2 - c1 + 1);
-	for (r = r1, offset = r1 * cols + c1; r <= r2; ++r) {
-		for (c = c1; c <= c2; ++c, ++offset) {
-			sum += (t = x[offset]);
+	for (r = 0; r <= 2 * w; ++r) {
+		if (!x[r])
+			continue;
+		for (c = c1; c <= c2; ++c, ++n) {
+			sum += (t = x[r][c]);
 			if (min > t)
 				min = t;
 			if (max < t)
 				max = t;
 		}
-		offset += (cols - d);
 	}
 	return (sum - min - max - pix) / (n - 3);
 }
@@ -418,12 +2130,221 @@ bool ADIProcess::load_badpixel(const string &filepath) {
 	return false;
 }
 
-void ADIProcess::pre_process() {
+void ADIProcess::pre_process(float *data, int x0, int y0, int width,
+		int height, float exptime, const CosmicMask *mask, float *weight) {
+	bool debias(info_.valid_zero), dedark(info_.valid_dark && exptime > 0.0);
+	bool deflat(info_.valid_flat);
+	float *vz = debias ? var_[IMGTYP_ZERO].get() : NULL;
+	float *vd = dedark ? var_[IMGTYP_DARK].get() : NULL;
+	float *vf = deflat ? var_[IMGTYP_FLAT].get() : NULL;
+	float gain(detector_.gain > 0.0 ? detector_.gain : 1.0);
+	float rn2(detector_.readnoise / gain), t2(exptime * exptime);
+	/* 暗场方差含zcoef^2倍本底方差, 而暗场中的本底误差与直接扣除的本底误差
+	 * 相关: 本底误差项为(1 - t * zcoef)^2 * vz. 展开后与t2 * vd合并为
+	 * (1 - 2 * t * zcoef) * vz. 平场中的本底误差项系数约为1/中值, 忽略其相关
+	 */
+	float zk(vd ? 1.0 - 2.0 * exptime * zcoef_[IMGTYP_DARK] : 1.0);
+	int i, j, off;
+	float *x, *w(NULL), v, s, f;
 
+	rn2 *= rn2;
+	for (i = 0; i < height; ++i) {
+		x = data + i * width;
+		if (weight)
+			w = weight + i * width;
+		off = (y0 + i) * info_.wdim + x0;
+		for (j = 0; j < width; ++j, ++off) {
+			v = x[j];
+			if (debias)
+				v -= zero_[off];
+			if (w) {// 原始数据泊松噪声与读出噪声, 叠加标定图像方差
+				s = (v > 0.0 ? v / gain : 0.0) + rn2;
+				if (vz)
+					s += vz[off] * zk;
+				if (vd)
+					s += t2 * vd[off];
+			}
+			if (dedark)
+				v -= dark_[off] * exptime;
+			if (deflat) {
+				if ((f = flat_[off]) > 0.0) {
+					v /= f;
+					if (w)
+						s = (s + (vf ? v * v * vf[off] : 0.0)) / (f * f);
+				}
+				else if (w)
+					s = 0.0;
+			}
+			x[j] = v;
+			if (w)
+				w[j] = s > 0.0 ? 1.0 / s : 0.0;
+		}
+	}
+	if (mask) {
+		repair_cosmic(data, x0, y0, width, height, *mask);
+		for (i = 0; weight && i < height; ++i) {
+			for (j = 0; j < width; ++j) {
+				if (mask->Test(x0 + j, y0 + i))
+					weight[i * width + j] = 0.0;
+			}
+		}
+	}
+}
+
+bool ADIProcess::cosmic_tile(cosmic_ctx *ctx, int itile, int ithread) {
+	// 分块及外扩后的范围, 相对区域起始位置
+	int cx0 = (itile % ctx->ntx) * ctx->tile;
+	int cy0 = (itile / ctx->ntx) * ctx->tile;
+	int cx1 = min(cx0 + ctx->tile, ctx->width);
+	int cy1 = min(cy0 + ctx->tile, ctx->height);
+	int ex0 = max(cx0 - COSMIC_HALO, 0), ey0 = max(cy0 - COSMIC_HALO, 0);
+	int ex1 = min(cx1 + COSMIC_HALO, ctx->width);
+	int ey1 = min(cy1 + COSMIC_HALO, ctx->height);
+	int w(ex1 - ex0), h(ey1 - ey0), n(w * h), i, j, k, x, y, c;
+	// 使用本线程的缓存区, 各分块复用
+	float *img = ctx->buff.get() + ithread * ctx->stride, *lap = img + n;
+	float *noise = lap + n, *sp = noise + n, *med = sp + n, *tmp = med + n;
+	char *flag = (char*) (tmp + max(n, 3 * w)), *grow = flag + n;
+	float gain(detector_.gain > 0.0 ? detector_.gain : 1.0);
+	float rn2(detector_.readnoise * detector_.readnoise), v;
+	float thresh(cosmic_.sigclip), thlow(cosmic_.sigclip * cosmic_.sigfrac);
+
+	// 复制并改正
+	for (y = 0; y < h; ++y)
+		memcpy(img + y * w, ctx->data + (ey0 + y) * ctx->width + ex0,
+				w * sizeof(float));
+	pre_process(img, ctx->x0 + ex0, ctx->y0 + ey0, w, h, ctx->exptime);
+	// 拉普拉斯信噪比, 扣除大尺度结构
+	laplace_plus(img, lap, w, h);
+	median_sep(img, noise, w, h, 5, tmp);
+	for (i = 0; i < n; ++i) {
+		v = noise[i] > 0.0001f ? noise[i] : 0.0001f;
+		noise[i] = sqrt(v * gain + rn2) / gain;
+		sp[i] = lap[i] / (2.0f * noise[i]);
+	}
+	median_sep(sp, med, w, h, 5, tmp);
+	for (i = 0; i < n; ++i)
+		sp[i] -= med[i];
+	// 精细结构: 区分恒星
+	median3x3(img, lap, w, h, tmp);
+	median_sep(lap, med, w, h, 7, tmp);
+	for (i = 0; i < n; ++i) {
+		v = (lap[i] - med[i]) / noise[i];
+		lap[i] = v > 0.01f ? v : 0.01f;
+	}
+	// 候选像素, 并两次向邻近像素扩展
+	for (i = 0; i < n; ++i)
+		flag[i] = sp[i] > thresh && sp[i] / lap[i] > cosmic_.objlim;
+	for (k = 0; k < 2; ++k) {
+		v = k ? thlow : thresh;
+		for (y = 0; y < h; ++y) {
+			for (x = 0; x < w; ++x) {
+				i = y * w + x;
+				grow[i] = 0;
+				if (sp[i] <= v)
+					continue;
+				for (j = max(y - 1, 0); j <= min(y + 1, h - 1) && !grow[i]; ++j) {
+					for (c = max(x - 1, 0); c <= min(x + 1, w - 1); ++c) {
+						if (flag[j * w + c]) {
+							grow[i] = 1;
+							break;
+						}
+					}
+				}
+			}
+		}
+		std::swap(flag, grow);
+	}
+	// 仅标记分块内像素. 分块起始列为32的倍数, 各线程写入的位图字不重叠
+	for (y = cy0; y < cy1; ++y) {
+		for (x = cx0; x < cx1; ++x) {
+			if (flag[(y - ey0) * w + x - ex0])
+				ctx->mask->Set(ctx->x0 + x, ctx->y0 + y);
+		}
+	}
+	return true;
 }
 
-void ADIProcess::do_process() {
+void ADIProcess::EstimateBackground(const float *data, int n, float &back,
+		float &rms) {
+	int ns(n > SAMPLE_PIXELS ? SAMPLE_PIXELS : n), i, half;
+	float step, pos(0.0);
+
+	back = rms = 0.0;
+	if (n < 1)
+		return;
+	step = float(n) / ns;
+	fltarr buff = pool_.Alloc(ns);
+	float *smp = buff.get();
+	for (i = 0; i < ns; ++i, pos += step)
+		smp[i] = data[int(pos)];
+	if (!(ns = pack_finite(smp, ns)))
+		return;
+	half = ns / 2;
+	nth_element(smp, smp + half, smp + ns);
+	back = smp[half];
+	for (i = 0; i < ns; ++i)
+		smp[i] = fabs(smp[i] - back);
+	nth_element(smp, smp + half, smp + ns);
+	rms = 1.4826 * smp[half];
+}
+
+void ADIProcess::ExtractObjects(const float *data, int width, int height,
+		float &back, float &rms, ObjectVec &objects) {
+	int n(width * height), i, j, k, p, q, x, y;
+	float thresh, v;
+
+	EstimateBackground(data, n, back, rms);
+	if (!n)
+		return;
+	thresh = back + dip_.snr * rms;
 
+	// 8连通域提取高于阈值的像素. 各像素至多入栈一次
+	fltarr buff = pool_.Alloc(n + (n + sizeof(float) - 1) / sizeof(float));
+	int *stack = (int*) buff.get(), top(0);
+	char *flag = (char*) (stack + n);
+	dip_object obj;
+	double sum, sx, sy;
+
+	memset(flag, 0, n);
+	for (p = 0; p < n; ++p) {
+		if (flag[p] || !(data[p] > thresh)) // NaN不参与
+			continue;
+		flag[p] = 1;
+		stack[top++] = p;
+		sum = sx = sy = 0.0;
+		obj.peak = 0.0;
+		obj.area = 0;
+		while (top) {
+			q = stack[--top];
+			x = q % width;
+			y = q / width;
+			v = data[q] - back;
+			sum += v;
+			sx += v * x;
+			sy += v * y;
+			if (v > obj.peak)
+				obj.peak = v;
+			++obj.area;
+			for (j = y - 1; j <= y + 1; ++j) {
+				if (j < 0 || j >= height)
+					continue;
+				for (i = x - 1; i <= x + 1; ++i) {
+					k = j * width + i;
+					if (i >= 0 && i < width && !flag[k] && data[k] > thresh) {
+						flag[k] = 1;
+						stack[top++] = k;
+					}
+				}
+			}
+		}
+		if (obj.area >= dip_.minarea && sum > 0.0) {
+			obj.x = sx / sum;
+			obj.y = sy / sum;
+			obj.flux = sum;
+			objects.push_back(obj);
+		}
+	}
 }
 //////////////////////////////////////////////////////////////////////////////
 } /* namespace AstroUtil */
@@ -5,6 +5,8 @@
  * @note
  * - 图像合并: 本底, 暗场, 平场. 合并图像以float型格式存储
  * - 原始文件中, EXPTIME对应曝光时间
+ * - 内存接口(CombineStack/SetMaster/CalibrateFrame/ExtractObjects)直接处理调用方
+ *   数组, 供python/fitspremodule.cpp使用
  */
 
 #ifndef ADIPROCESS_H_
@@ -12,30 +14,209 @@
 
 #include <boost/smart_ptr.hpp>
 #include <boost/container/stable_vector.hpp>
+#include <boost/thread/mutex.hpp>
 #include <string>
+#include <vector>
 #include "FitsHandler.h"
+#include "BufferPool.h"
+#include "AsyncWriter.h"
+#include "FFTCorr.h"
+#include "CosmicRay.h"
+#include "FrameIndex.h"
 
 using std::string;
 
 namespace AstroUtil {
 // 声明数据类型
-typedef boost::shared_array<float> fltarr;
 typedef boost::container::stable_vector<float> fltvec;
 typedef boost::shared_ptr<FitsHandler> FitsHPtr;
 //typedef boost::container::stable_vector<FitsHPtr> FitsHPtrVec;
 
 struct FitsInfo { // fits文件信息
 	FitsHPtr hptr;	//< 访问指针
+	string filepath;	//< 文件路径
 	float scale;	//< 归一化比例尺
+	float median;	//< 抽样中值
+	float rms;		//< 抽样噪声. 由中值绝对偏差估算
+	float satfrac;	//< 抽样中饱和像素比例
+	float exptime;	//< 曝光时间. 用于叠加
+	float dx, dy;	//< 相对参考帧的偏移. 用于叠加
 };
 typedef boost::shared_ptr<FitsInfo> FitsNFPtr;
 typedef boost::container::stable_vector<FitsNFPtr> FitsNFPtrVec;
 
 //////////////////////////////////////////////////////////////////////////////
+enum {	//< 图像类型
+	IMGTYP_ZERO,	//< 本底
+	IMGTYP_DARK,	//< 暗场
+	IMGTYP_FLAT,	//< 平场
+	IMGTYP_OBJECT	//< 目标
+};
+
+enum {	//< 输出图像数据类型
+	OUTPUT_FLOAT,	//< 32位浮点数
+	OUTPUT_INT16	//< 16位整数, 由BSCALE/BZERO换算为物理量, BLANK标识空值
+};
+
+struct param_calib {	//< 标定图像合并参数
+	string dir_zero, prefix_zero;	//< 本底文件目录与文件名前缀
+	string dir_dark, prefix_dark;	//< 暗场文件目录与文件名前缀
+	string dir_flat, prefix_flat;	//< 平场文件目录与文件名前缀
+	string dir_output;	//< 合并结果存储目录. 为空时存储在原始文件目录
+	int nthread;		//< 调度线程数. <= 0时使用处理器核数
+
+public:
+	param_calib() {
+		nthread = 0;
+	}
+};
+
+struct param_screen {	//< 合并前图像质量筛选参数
+	bool enable;		//< 启用筛选
+	float median_min, median_max;	//< 抽样中值范围. max < min时不限制
+	float rms_max;		//< 抽样噪声上限. <= 0时不限制
+	float saturation;	//< 饱和阈值. <= 0时不统计饱和像素
+	float satfrac_max;	//< 饱和像素比例上限
+
+public:
+	param_screen() {
+		enable = false;
+		median_min = 0.0;
+		median_max = -1.0;
+		rms_max = 0.0;
+		saturation = 0.0;
+		satfrac_max = 1.0;
+	}
+};
+
+struct param_overscan {	//< 过扫区改正参数
+	bool enable;		//< 启用过扫区改正和裁剪
+	string trimsec;		//< 有效区, 格式: [x1:x2,y1:y2]. 为空时使用关键字TRIMSEC
+	string biassec;		//< 过扫区. 为空时使用关键字BIASSEC
+	int smooth;			//< 过扫区逐行电平的平滑窗口行数
+
+public:
+	param_overscan() {
+		enable = false;
+		smooth = 15;
+	}
+};
+
+struct param_coadd {	//< 图像叠加参数
+	string dir, prefix;	//< 已定标或待定标图像的目录与文件名前缀
+	string output;		//< 叠加结果文件路径
+	int binning;		//< 估计偏移时的降采样因子. <= 0时自动选择
+	bool bilinear;		//< 平移方式. true: 双线性插值; false: 整像素
+	bool sigclip;		//< 合并方式. true: avsigclip; false: minmax_clip
+
+public:
+	param_coadd() {
+		binning = 0;
+		bilinear = true;
+		sigclip = true;
+	}
+};
+
+struct mem_plan {	//< 内存规划. 各任务持有独立副本
+	size_t bytes;	//< 单个任务可用内存, 量纲: 字节. 0: 不限制
+	int nthread;	//< 合并线程数
+	int rows_block;	//< 合并时每次读取的行数
+	int nframe;		//< 并行统计的帧数
+	bool incore;	//< 统计方式. true: 载入整帧; false: 逐行抽样
+
+public:
+	mem_plan() {
+		bytes = 0;
+		nthread = rows_block = nframe = 1;
+		incore = true;
+	}
+};
+
+struct quant_info {	//< 16位输出量化参数
+	int mode;		//< 输出数据类型
+	float bscale, bzero;	//< 整数量化系数: 物理量 = 整数 * bscale + bzero
+	float noise;	//< 图像噪声
+	float qerr;		//< 量化误差均方根
+};
+
+struct quant_stats {	//< 16位输出统计信息
+	unsigned long nframe;	//< 以16位输出的文件数
+	unsigned long nfloat;	//< 因量化误差超限改为32位输出的文件数
+	float ratio_max;		//< 量化误差与噪声之比的最大值
+};
+
 struct param_dip {	//< 图像处理及信号提取参数
 	int bkw, bkh;		//< 背景拟合窗口
 	int bkfrw, bkfh;	//< 背景拟合滤波窗口
 	int minarea;		//< 最小连通域面积
+	float snr;			//< 信号提取阈值, 噪声倍数
+
+public:
+	param_dip() {
+		bkw = bkh = 64;
+		bkfrw = bkfh = 3;
+		minarea = 5;
+		snr = 3.0;
+	}
+};
+
+struct param_detector {	//< 探测器噪声参数
+	float gain;			//< 增益, 量纲: e-/ADU
+	float readnoise;	//< 读出噪声, 量纲: e-
+
+public:
+	param_detector() {
+		gain = 1.0;
+		readnoise = 10.0;
+	}
+};
+
+struct param_cosmic {	//< 宇宙线识别参数
+	bool enable;		//< 识别并修复宇宙线
+	float sigclip;		//< 拉普拉斯信噪比阈值
+	float sigfrac;		//< 邻近像素阈值与sigclip之比
+	float objlim;		//< 拉普拉斯与精细结构之比的下限. 用于区分恒星
+	int tile;			//< 并行分块尺寸
+
+public:
+	param_cosmic() {
+		enable = false;
+		sigclip = 4.5;
+		sigfrac = 0.3;
+		objlim = 5.0;
+		tile = 256;
+	}
+};
+
+struct param_roi {	//< 快速查看区域
+	int x0, y0;			//< 区域起始位置, 从0开始
+	int width, height;	//< 区域尺寸
+	bool sky;			//< 以天球坐标指定区域中心
+	double ra, dec;		//< 区域中心赤经/赤纬, 量纲: 角度
+
+public:
+	param_roi() {
+		x0 = y0 = width = height = 0;
+		sky = false;
+		ra = dec = 0.0;
+	}
+};
+
+struct dip_object {	//< 提取的目标
+	float x, y;		//< 流量加权中心位置, 从0开始
+	float flux;		//< 扣除背景后的流量
+	float peak;		//< 扣除背景后的峰值
+	int area;		//< 连通域面积
+};
+typedef std::vector<dip_object> ObjectVec;
+
+struct roi_result {	//< 快速查看结果
+	int x0, y0;			//< 实际区域起始位置. 区域超出图像时裁剪
+	int width, height;	//< 实际区域尺寸
+	float exptime;		//< 曝光时间
+	float back, rms;	//< 区域背景和噪声
+	fltarr data;		//< 改正后的区域图像
+	ObjectVec objects;	//< 目标. 位置相对整幅图像
 };
 
 struct info_adip {
@@ -61,11 +242,69 @@ public:
 
 protected:
 	info_adip info_;	//< 图像信息
+	BufferPool pool_;	//< 数据缓存区池. 各接口的临时缓存区和标定图像均由池分配
 	fltarr zero_;	//< 本底数据
 	fltarr dark_;	//< 暗场数据
 	fltarr flat_;	//< 平场数据
 	fltarr back_;	//< 图像背景
-	fltarr rms_;	//< 图像噪声
+	fltarr var_[3];		//< 标定图像逐像素方差. 下标为图像类型
+	fltarr ncomb_[3];	//< 标定图像逐像素参与合并的帧数. 下标为图像类型
+	float zcoef_[3];	//< 暗场和平场方差所含本底方差的系数: 方差含zcoef^2倍本底方差
+	size_t mem_budget_;	//< 内存预算, 量纲: 字节. 0: 不限制
+	param_screen screen_[3];	//< 各类型标定图像的筛选参数
+	frame_filter filter_;	//< 扫描目录时的文件头筛选条件. 前缀由各接口指定
+	int outmode_;		//< 输出图像数据类型
+	param_overscan overscan_;	//< 过扫区改正参数
+	param_dip dip_;		//< 图像处理及信号提取参数
+	param_coadd coadd_;	//< 图像叠加参数
+	param_cosmic cosmic_;	//< 宇宙线识别参数
+	param_detector detector_;	//< 探测器噪声参数
+	bool weight_;		//< 处理图像时输出权重扩展
+	quant_stats quant_;	//< 16位输出统计信息
+	boost::mutex mtx_quant_;	//< 统计信息互斥锁
+	AsyncWriter writer_;	//< 异步写入. 写入线程访问上述成员, 须最后构造, 最先析构
+
+protected:
+	struct band_ctx {	//< 分块合并上下文
+		int type;			//< 图像类型
+		FitsNFPtrVec *vec;	//< 待合并文件
+		int row0, row1;		//< 行区间[row0, row1)
+		float *data;		//< 合并结果
+		float *var;			//< 合并结果方差. 为NULL时不统计
+		float *ncomb;		//< 参与合并的帧数. 为NULL时不统计
+		int nframe;			//< 待合并帧数
+		const float *stack;	//< 内存中待合并数据, 各帧连续存储. 为NULL时读取文件
+		const float *scales;	//< 各帧归一化系数. 本底不使用
+		float zcoef;		//< 本底方差计入合并结果方差的系数. 0: 不计入
+		mem_plan plan;		//< 内存规划
+		fltarr rowbuff;		//< 各线程分块数据缓存区
+		fltarr pixbuff;		//< 各线程像素数据缓存区
+		fltarr rawbuff;		//< 各线程单帧平移前数据缓存区. 用于叠加
+		boost::mutex mtx;	//< 文件读取互斥锁
+	};
+
+	struct cosmic_ctx {	//< 宇宙线识别上下文
+		const float *data;	//< 区域数据
+		int x0, y0;			//< 区域起始位置
+		int width, height;	//< 区域尺寸
+		float exptime;		//< 曝光时间
+		int tile;			//< 分块尺寸, 32的倍数
+		int ntx, nty;		//< 分块数
+		CosmicMask *mask;	//< 宇宙线标记
+		size_t stride;		//< 单个线程的缓存区长度
+		fltarr buff;		//< 各线程分块缓存区, 以线程序号索引
+	};
+
+	struct offset_ctx {	//< 偏移估计上下文
+		FitsNFPtrVec *vec;	//< 待叠加文件
+		int binning;		//< 降采样因子
+		int bw, bh;			//< 降采样图像尺寸
+		int nw, nh;			//< 降采样频谱尺寸
+		int wsize;			//< 精化窗口尺寸
+		int wx0, wy0;		//< 参考帧精化窗口起始位置
+		fltarr refspec;		//< 参考帧降采样频谱. 以cplx存储
+		fltarr winspec;		//< 参考帧精化窗口频谱. 以cplx存储
+	};
 
 public:
 	/*!
@@ -113,6 +352,288 @@ public:
 	 * 本底加载结果
 	 */
 	bool SetFlat(const string &filepath);
+	/*!
+	 * @brief 一次完成本底、暗场和平场合并
+	 * @param param 标定图像参数
+	 * @return
+	 * 合并结果
+	 * @note
+	 * - 相同目录只扫描一次. 前缀为空时, 依据关键字IMAGETYP区分图像类型
+	 * - 各合并步骤按依赖关系调度: 暗场和平场依赖内存中的本底, 平场比例尺
+	 *   统计与本底合并并行执行
+	 */
+	bool CombineAll(const param_calib &param);
+	/*!
+	 * @brief 分片合并的准备步骤: 选择并筛选文件, 计算各帧归一化系数
+	 * @param type     图像类型
+	 * @param pathname 原始文件目录
+	 * @param prefix   文件名前缀
+	 * @param output   结果目录. 计划文件存储在该目录
+	 * @return
+	 * 准备结果
+	 * @note
+	 * 计划文件记录参与合并的文件及其归一化系数, 各分片直接使用, 不再重复
+	 * 筛选和统计平场中值
+	 */
+	bool PrepareShard(int type, const string &pathname, const string &prefix,
+			const string &output);
+	/*!
+	 * @brief 分片合并: 合并行区间内的标定图像, 结果存储为局部FITS文件
+	 * @param type     图像类型
+	 * @param pathname 原始文件目录
+	 * @param prefix   文件名前缀
+	 * @param output   结果目录. 局部文件存储在该目录
+	 * @param ishard   分片序号. 从0开始
+	 * @param nshard   分片总数
+	 * @return
+	 * 分片合并结果
+	 * @note
+	 * - 第ishard分片的行区间为[rows * ishard / nshard, rows * (ishard + 1) / nshard)
+	 * - 局部文件先以临时文件名写入, 完成后更名, 拼接步骤不会读到未完成的文件
+	 * - 各分片相互独立, 可由不同进程或不同节点执行
+	 * - 结果目录中存在同一原始目录的计划文件时使用计划, 否则自行准备
+	 */
+	bool CombineShard(int type, const string &pathname, const string &prefix,
+			const string &output, int ishard, int nshard);
+	/*!
+	 * @brief 拼接分片合并结果, 生成合并后标定图像
+	 * @param type     图像类型
+	 * @param pathname 结果目录. 局部文件和合并结果均在该目录
+	 * @param timeout  等待全部局部文件的最长时间, 量纲: 秒
+	 * @return
+	 * 拼接结果
+	 * @note
+	 * - 拼接成功后删除局部文件和计划文件
+	 * - 尺寸与已加载标定图像不同时, 按prepare_dimension()规则处理
+	 */
+	bool MergeShard(int type, const string &pathname, int nshard,
+			int timeout = 0);
+	/*!
+	 * @brief 设置内存预算
+	 * @param bytes 内存预算, 量纲: 字节. 0: 不限制
+	 * @note
+	 * - 各接口先扣除驻留数据(标定图像、文件句柄、单帧数据及异步写入队列),
+	 *   再依据剩余预算规划线程数、分块行数和统计方式, 预算不足时处理失败
+	 * - 数据缓存区池以预算扣除池外内存(cfitsio文件句柄、宇宙线标记)为硬上限,
+	 *   超出时申请失败而非超用内存
+	 */
+	void SetMemoryBudget(size_t bytes);
+	/*!
+	 * @brief 设置数据缓存区是否使用大页内存
+	 */
+	void SetHugePage(bool enable);
+	/*!
+	 * @brief 查询数据缓存区池统计信息
+	 * @param reset 查询后清除申请次数统计
+	 * @return
+	 * 统计信息. 稳态时向系统申请内存次数不再增加
+	 */
+	pool_stats PoolStats(bool reset = false);
+	/*!
+	 * @brief 设置过扫区改正参数
+	 * @param param 过扫区改正参数
+	 * @note
+	 * 作用于待合并的原始文件. 读取时逐行扣除过扫区电平并裁剪至有效区,
+	 * 后续合并、统计和输出均仅处理有效区
+	 */
+	void SetOverscan(const param_overscan &param);
+	/*!
+	 * @brief 平移叠加已定标图像
+	 * @param param 叠加参数
+	 * @return
+	 * 叠加结果
+	 * @note
+	 * - 以文件名排序后的首帧为参考帧. 降采样图像的FFT互相关估计粗偏移,
+	 *   再以图像中心全分辨率窗口的互相关精化
+	 * - 已加载标定图像时, 读取后先定标
+	 * - 复用合并的分块并行机制, 各帧平移后逐像素筛选合并. 未覆盖像素为nan
+	 */
+	bool Coadd(const param_coadd &param);
+	/*!
+	 * @brief 等待全部待写入文件写入完成
+	 * @param failed 自上次调用以来写入失败的文件路径, 追加至末尾. 可为NULL
+	 * @return
+	 * 自上次调用以来的文件是否均写入成功
+	 * @note
+	 * - CombineZero/CombineDark/CombineFlat和ProcessImage提交写入后即返回,
+	 *   写入与后续计算并行. 其返回值不含写入结果, 须由Flush()确认
+	 * - CombineAll、CombineShard、MergeShard和Coadd返回前已等待写入完成
+	 */
+	bool Flush(std::vector<string> *failed = NULL);
+	/*!
+	 * @brief 设置待写入队列容量
+	 * @param n 队列容量. 队列满时, 提交写入的计算线程等待
+	 */
+	void SetWriteQueue(int n);
+	/*!
+	 * @brief 设置图像处理及信号提取参数
+	 */
+	void SetProcess(const param_dip &param);
+	/*!
+	 * @brief 快速查看: 仅读取并处理图像中的指定区域
+	 * @param filepath 文件路径
+	 * @param roi      区域. 以像素位置或天球坐标(需WCS)指定
+	 * @param rslt     处理结果
+	 * @return
+	 * 处理结果. 文件与已加载标定图像尺寸不一致或区域位于图像外时返回false
+	 * @note
+	 * - 逐行读取区域覆盖的列, 以标定图像的对应区域改正
+	 * - 区域内以中值和中值绝对偏差估计背景和噪声, 并提取目标
+	 */
+	bool ProcessROI(const string &filepath, const param_roi &roi,
+			roi_result &rslt);
+	/*!
+	 * @brief 设置宇宙线识别参数
+	 * @note
+	 * 启用后, 处理图像和快速查看时识别并修复宇宙线
+	 */
+	void SetCosmic(const param_cosmic &param);
+	/*!
+	 * @brief 设置探测器噪声参数
+	 * @note
+	 * 用于宇宙线识别和权重计算
+	 */
+	void SetDetector(const param_detector &param);
+	/*!
+	 * @brief 设置处理图像时是否输出权重扩展
+	 * @note
+	 * 权重为改正后各像素方差的倒数, 存储为扩展WEIGHT. 方差包括读出噪声、
+	 * 泊松噪声及标定图像的逐像素方差. 修复的宇宙线像素权重为0
+	 */
+	void SetWeightMap(bool enable);
+	/*!
+	 * @brief 识别图像区域中的宇宙线
+	 * @param data    未改正的区域数据
+	 * @param x0      区域起始列
+	 * @param y0      区域起始行
+	 * @param width   区域宽度
+	 * @param height  区域高度
+	 * @param exptime 曝光时间
+	 * @param mask    宇宙线标记. 覆盖该区域
+	 * @return
+	 * 宇宙线像素数. 失败时返回-1
+	 * @note
+	 * - 区域按分块并行识别, 分块外扩邻域以保证滤波结果与整幅计算一致
+	 * - 各分块复制数据后以标定图像改正, 不修改data
+	 */
+	int DetectCosmic(const float *data, int x0, int y0, int width, int height,
+			float exptime, CosmicMask &mask);
+	/*!
+	 * @brief 处理图像: 定标并修复宇宙线
+	 * @param filepath 文件路径
+	 * @param output   处理结果文件路径
+	 * @return
+	 * 处理结果. 结果文件异步写入, 写入结果由Flush()返回
+	 * @note
+	 * 结果文件保留原始文件头(见FitsHandler::GetHeader()), 并添加处理参数
+	 */
+	bool ProcessImage(const string &filepath, const string &output);
+	/*!
+	 * @brief 合并内存中的标定帧
+	 * @param type   图像类型. IMGTYP_ZERO/IMGTYP_DARK/IMGTYP_FLAT
+	 * @param stack  待合并数据, 各帧按行连续存储, 长度为nframe * cols * rows
+	 * @param nframe 帧数. 不少于3
+	 * @param cols   列数
+	 * @param rows   行数
+	 * @param scales 各帧归一化系数. 暗场为曝光时间, 不可为NULL;
+	 *               平场为NULL时以各帧抽样中值归一化
+	 * @param data   合并结果存储区, 长度为cols * rows
+	 * @param var    合并结果方差存储区. 为NULL时不统计. 仅含帧间离散,
+	 *               不含本底方差, 可直接传给SetMaster()
+	 * @param ncomb  参与合并的帧数存储区. 为NULL时不统计
+	 * @return
+	 * 合并结果. 暗场和平场减已加载本底. 尺寸与已加载标定图像不一致时返回false,
+	 * 已加载标定图像保持不变
+	 * @note
+	 * - 与文件合并使用相同的分块并行核, 直接访问stack, 不复制帧数据
+	 * - 结果不替换已加载标定图像, 需要时调用SetMaster()
+	 */
+	bool CombineStack(int type, const float *stack, int nframe, int cols,
+			int rows, const float *scales, float *data, float *var = NULL,
+			float *ncomb = NULL);
+	/*!
+	 * @brief 查询已加载标定图像的尺寸
+	 * @param cols 列数
+	 * @param rows 行数
+	 * @return
+	 * 已加载任一标定图像时返回true
+	 */
+	bool MasterDimension(int &cols, int &rows);
+	/*!
+	 * @brief 以内存数据设置标定图像
+	 * @param type 图像类型. IMGTYP_ZERO/IMGTYP_DARK/IMGTYP_FLAT
+	 * @param data 标定图像. 暗场为单位曝光时间暗流
+	 * @param cols 列数
+	 * @param rows 行数
+	 * @param var  逐像素方差. 可为NULL. 暗场和平场的方差视为不含本底方差
+	 * @return
+	 * 设置结果. 暗场和平场与本底尺寸不一致时返回false
+	 */
+	bool SetMaster(int type, const float *data, int cols, int rows,
+			const float *var = NULL);
+	/*!
+	 * @brief 就地定标内存中的图像: 减本底/减暗场/除平场, 并按参数修复宇宙线
+	 * @param data    图像数据
+	 * @param cols    列数
+	 * @param rows    行数
+	 * @param exptime 曝光时间
+	 * @param weight  逆方差权重存储区, 长度为cols * rows. 为NULL时不计算
+	 * @return
+	 * 修复的宇宙线像素数. 与已加载标定图像尺寸不一致时返回-1
+	 */
+	int CalibrateFrame(float *data, int cols, int rows, float exptime,
+			float *weight = NULL);
+	/*!
+	 * @brief 以抽样中值和中值绝对偏差估计背景和噪声
+	 * @param data 图像数据
+	 * @param n    像素数
+	 * @param back 背景
+	 * @param rms  噪声
+	 * @note
+	 * 样本剔除NaN和Inf. 无有效样本时背景和噪声为0
+	 */
+	void EstimateBackground(const float *data, int n, float &back, float &rms);
+	/*!
+	 * @brief 提取图像中目标
+	 * @param data    图像数据
+	 * @param width   图像宽度
+	 * @param height  图像高度
+	 * @param back    背景
+	 * @param rms     噪声
+	 * @param objects 目标. 位置相对图像
+	 * @note
+	 * 背景和噪声由EstimateBackground()估计, 8连通域提取高于阈值的目标. NaN像素不参与
+	 */
+	void ExtractObjects(const float *data, int width, int height, float &back,
+			float &rms, ObjectVec &objects);
+	/*!
+	 * @brief 设置输出图像数据类型
+	 * @param mode 数据类型. OUTPUT_FLOAT/OUTPUT_INT16
+	 * @note
+	 * - 作用于合并后的标定图像和处理后的图像. 分片合并的局部文件总是32位输出
+	 * - 16位输出时, 依据抽样噪声评估量化误差. 误差超过噪声的1/4时该文件改为32位输出
+	 */
+	void SetOutputMode(int mode);
+	/*!
+	 * @brief 查询16位输出统计信息
+	 */
+	quant_stats QuantStats();
+	/*!
+	 * @brief 设置合并前图像质量筛选参数
+	 * @param type  图像类型
+	 * @param param 筛选参数
+	 * @note
+	 * 合并前逐行抽样统计各文件的中值、噪声和饱和像素比例, 剔除超出限制的文件
+	 */
+	void SetScreen(int type, const param_screen &param);
+	/*!
+	 * @brief 设置扫描目录时的文件头筛选条件
+	 * @param filter 筛选条件. 忽略其中的文件名前缀
+	 * @note
+	 * 合并、叠加及分片合并扫描目录时, 仅使用IMAGETYP、曝光时间和图像尺寸
+	 * 符合条件的文件
+	 */
+	void SetFilter(const frame_filter &filter);
 	/*!
 	 * @brief 重置标定用图像
 	 * @param type 图像类型. 0: 本底; 1: 暗场; 2: 平场
@@ -121,6 +642,38 @@ public:
 	void Reset(int type = 0);
 
 protected:
+	/*!
+	 * @brief 加载合并后暗场或平场
+	 * @param type     图像类型
+	 * @param filepath 文件路径
+	 * @return
+	 * 加载结果. 与已加载标定图像尺寸不一致时返回false
+	 */
+	bool load_master(int type, const string &filepath);
+	/*!
+	 * @brief 加载标定图像的方差和合并帧数扩展. 缺少扩展时不使用方差
+	 * @param fh   已加载主图像的FITS文件
+	 * @param type 图像类型
+	 */
+	void load_variance(FitsHandler &fh, int type);
+	/*!
+	 * @brief 计算扣除本底的合并结果中本底误差的系数
+	 * @param vec 待合并文件. 已确定各帧归一化系数
+	 * @return
+	 * 各帧系数倒数的均值. 未加载本底或本底无方差时为0
+	 * @note
+	 * 各帧扣除同一本底, 本底误差不体现在帧间离散中, 需单独计入合并结果方差.
+	 * 以全部帧而非保留帧的均值近似
+	 */
+	float zero_coef(FitsNFPtrVec &vec);
+	/*!
+	 * @brief 打开原始文件, 并依据参数启用过扫区改正
+	 * @param fhptr    FITS文件
+	 * @param filepath 文件路径
+	 * @return
+	 * 文件打开结果
+	 */
+	bool open_frame(FitsHPtr fhptr, const string &filepath);
 	/*!
 	 * @brief 扫描目录, 查找符合条件的文件
 	 * @param pathname 目录名
@@ -131,20 +684,336 @@ protected:
 	bool scan_directory(const string &pathname, const string &prefix,
 			FitsNFPtrVec &vec);
 	/*!
-	 * @brief 输出图像为FLOAT型FITS文件
+	 * @brief 扫描标定图像目录, 按类型归类文件
+	 * @param param 标定图像参数
+	 * @param vec   各类型FITS文件操作句柄. 下标为图像类型
+	 * @return
+	 * 至少一类图像数量满足合并条件时返回true
+	 * @note
+	 * 尺寸按prepare_dimension()规则确定, 与之不一致的类型不参与合并
+	 */
+	bool scan_calibration(const param_calib &param, FitsNFPtrVec vec[]);
+	/*!
+	 * @brief 检查图像尺寸一致性, 剔除与首个文件尺寸不同的文件
+	 * @param vec 文件操作句柄
+	 * @return
+	 * 文件数量满足合并条件时返回true
+	 */
+	bool check_dimension(FitsNFPtrVec &vec);
+	/*!
+	 * @brief 合并前检查文件并设置图像尺寸
+	 * @param type 图像类型
+	 * @param vec  待合并文件. 暗场剔除曝光时间无效的文件
+	 * @return
+	 * 文件满足合并条件时返回true
+	 */
+	bool prepare_combine(int type, FitsNFPtrVec &vec);
+	/*!
+	 * @brief 检查并设置标定图像尺寸
+	 * @param type 图像类型
+	 * @param cols 列数
+	 * @param rows 行数
+	 * @return
+	 * 暗场和平场与已加载本底尺寸不一致时返回false. 尺寸变化后已有标定图像失效
+	 */
+	bool prepare_dimension(int type, int cols, int rows);
+	/*!
+	 * @brief 合并标定图像, 结果存储在zero_/dark_/flat_
+	 * @param type 图像类型
+	 * @param vec  待合并文件. 平场归一化比例尺已计算
+	 * @param plan 内存规划. 已由share_memory()分配预算
+	 * @return
+	 * 合并结果
+	 * @note
+	 * 暗场结果为单位曝光时间暗流
+	 */
+	bool combine_master(int type, FitsNFPtrVec &vec, mem_plan plan);
+	/*!
+	 * @brief 合并行区间[row0, row1)内的标定图像数据
+	 * @param type 图像类型
+	 * @param vec  待合并文件. 已调用prepare_combine()
+	 * @param row0 起始行. 从0开始
+	 * @param row1 结束行. 不含该行
+	 * @param plan 内存规划. 已由share_memory()分配预算
+	 * @param data 合并结果存储区, 长度不小于(row1 - row0) * 列数
+	 * @param var   合并结果方差存储区, 长度同data. 为NULL时不统计
+	 * @param ncomb 参与合并的帧数存储区, 长度同data. 为NULL时不统计
+	 * @return
+	 * 合并结果
+	 * @note
+	 * 方差与帧数在合并的同一遍计算中得到, 不增加读取
+	 */
+	bool combine_band(int type, FitsNFPtrVec &vec, int row0, int row1,
+			mem_plan plan, float *data, float *var = NULL, float *ncomb = NULL);
+	/*!
+	 * @brief 计算各平场文件归一化比例尺
+	 * @param vec  平场文件
+	 * @param plan 内存规划. 已由share_memory()分配预算
+	 * @return
+	 * 计算结果
+	 */
+	bool normal_scales(FitsNFPtrVec &vec, mem_plan plan);
+	/*!
+	 * @brief 合并前筛选图像质量, 剔除不合格文件
+	 * @param type 图像类型
+	 * @param vec  待合并文件
+	 * @param plan 内存规划. 已由share_memory()分配预算
+	 * @return
+	 * 剩余文件满足合并条件时返回true
+	 */
+	bool screen_frames(int type, FitsNFPtrVec &vec, mem_plan plan);
+	/*!
+	 * @brief 线程函数: 抽样统计一个文件的中值、噪声和饱和像素比例
+	 * @param type  图像类型
+	 * @param vec   待合并文件
+	 * @param ifile 文件序号
+	 * @return
+	 * 总是返回true
+	 */
+	bool screen_frame(int type, FitsNFPtrVec *vec, int ifile);
+	/*!
+	 * @brief 统计驻留内存的整帧数据数量: 已加载标定图像及其方差和帧数
+	 */
+	int resident_planes();
+	/*!
+	 * @brief 计算异步写入占用的内存
+	 * @param job_bytes 单个写入任务新申请的数据量, 量纲: 字节.
+	 *                  引用驻留数据(如标定图像)的任务为0
+	 * @return
+	 * 队列中及写入中的任务数据, 以及写入时的量化缓存区. 不含写入文件句柄
+	 */
+	size_t writer_bytes(size_t job_bytes);
+	/*!
+	 * @brief 计算过扫区改正时文件句柄缓存的逐行电平
+	 * @param nhandle 文件句柄数量
+	 * @param rows    有效区行数
+	 * @return
+	 * 由缓存区池分配的内存, 量纲: 字节. 未启用过扫区改正时为0
+	 */
+	size_t level_bytes(size_t nhandle, int rows);
+	/*!
+	 * @brief 为并行任务分配内存预算
+	 * @param nplane 驻留内存的整帧数据数量
+	 * @param extra  其它由缓存区池分配的驻留内存, 量纲: 字节.
+	 *               如单帧数据、逐行电平和异步写入
+	 * @param ntask  并行任务数
+	 * @param plan   缺省规划及单个任务可用内存
+	 * @param fixed  池外内存, 量纲: 字节. 如cfitsio文件句柄和宇宙线标记
+	 * @return
+	 * 预算满足驻留数据需求时返回true
+	 * @note
+	 * - 预算通过plan按值传递给各任务, 并发执行的任务互不影响
+	 * - 池内存上限设置为预算扣除池外内存. 仅由处理入口调用, 不在任务中调用
+	 */
+	bool share_memory(int nplane, size_t extra, int ntask, mem_plan &plan,
+			size_t fixed = 0);
+	/*!
+	 * @brief 依据单个任务的内存预算, 规划合并和统计参数
+	 * @param nfile 文件数量
+	 * @param plan  规划结果. 输入时bytes为单个任务可用内存
+	 * @return
+	 * 预算满足最低需求时返回true
+	 */
+	bool plan_memory(int nfile, mem_plan &plan);
+	/*!
+	 * @brief 不受内存预算限制的缺省规划
+	 * @param plan 规划结果. 不改变bytes
+	 */
+	void default_plan(mem_plan &plan);
+	/*!
+	 * @brief 依据单个任务的内存预算, 规划宇宙线识别线程数
+	 * @param tile 分块尺寸
+	 * @param plan 规划结果. 输入时bytes为单个任务可用内存
+	 * @return
+	 * 预算满足单个分块需求时返回true
+	 * @note
+	 * 不依赖合并结果的图像尺寸, 可用于未加载合并结果的单帧处理
+	 */
+	bool plan_cosmic(int tile, mem_plan &plan);
+	/*!
+	 * @brief 线程函数: 合并一个分块
+	 * @param ctx     分块合并上下文
+	 * @param iblock  分块序号
+	 * @param ithread 线程序号
+	 * @return
+	 * 合并结果
+	 */
+	bool combine_block(band_ctx *ctx, int iblock, int ithread);
+	/*!
+	 * @brief 线程函数: 平移叠加一个分块
+	 * @param ctx     分块合并上下文
+	 * @param iblock  分块序号
+	 * @param ithread 线程序号
+	 * @return
+	 * 叠加结果
+	 */
+	bool coadd_block(band_ctx *ctx, int iblock, int ithread);
+	/*!
+	 * @brief 估计各帧相对参考帧的偏移
+	 * @param vec  待叠加文件. 首帧为参考帧
+	 * @param plan 内存规划. 已由share_memory()分配预算
+	 * @return
+	 * 估计结果. 无法估计偏移的文件被剔除
+	 * @note
+	 * 参考帧频谱常驻, 并行统计的帧数受各帧图像及频谱缓存区限制
+	 */
+	bool estimate_offsets(FitsNFPtrVec &vec, mem_plan plan);
+	/*!
+	 * @brief 线程函数: 估计一帧的偏移
+	 * @param ctx   偏移估计上下文
+	 * @param ifile 文件序号
+	 * @return
+	 * 总是返回true. 失败时偏移置为nan
+	 */
+	bool offset_frame(offset_ctx *ctx, int ifile);
+	/*!
+	 * @brief 加载降采样图像: 定标后按binning x binning取均值
+	 * @param info    FITS文件
+	 * @param binning 降采样因子
+	 * @param img     降采样图像
+	 * @return
+	 * 加载结果
+	 */
+	bool load_binned(FitsInfo &info, int binning, float *img);
+	/*!
+	 * @brief 加载定标后的方形窗口
+	 * @param info FITS文件
+	 * @param x0   起始列
+	 * @param y0   起始行
+	 * @param size 窗口尺寸
+	 * @param img  窗口数据
+	 * @return
+	 * 加载结果
+	 */
+	bool load_window(FitsInfo &info, int x0, int y0, int size, float *img);
+	/*!
+	 * @brief 扣除中值并截断负值, 突出恒星等信号
+	 */
+	void emphasize(float *img, int n);
+	/*!
+	 * @brief 线程函数: 计算一个平场文件的归一化比例尺
+	 * @param vec    平场文件
+	 * @param plan   内存规划
+	 * @param ifile  文件序号
+	 * @return
+	 * 计算结果
+	 */
+	bool scale_frame(FitsNFPtrVec *vec, const mem_plan *plan, int ifile);
+	/*!
+	 * @brief 生成分片合并局部文件路径
+	 * @param type     图像类型
+	 * @param pathname 存储目录
+	 * @param ishard   分片序号
+	 * @param nshard   分片总数
+	 * @return
+	 * 文件路径
+	 */
+	string shard_filepath(int type, const string &pathname, int ishard,
+			int nshard);
+	/*!
+	 * @brief 生成分片合并计划文件路径
+	 */
+	string shard_planpath(int type, const string &pathname);
+	/*!
+	 * @brief 选择参与分片合并的文件: 扫描、筛选并计算归一化系数
+	 * @param type     图像类型
+	 * @param pathname 原始文件目录
+	 * @param prefix   文件名前缀
+	 * @param vec      参与合并的文件
+	 * @return
+	 * 选择结果
+	 */
+	bool select_shard(int type, const string &pathname, const string &prefix,
+			FitsNFPtrVec &vec);
+	/*!
+	 * @brief 保存分片合并计划. 先写入临时文件再更名
+	 */
+	bool save_shard_plan(int type, const string &pathname,
+			const string &prefix, const string &output, FitsNFPtrVec &vec);
+	/*!
+	 * @brief 加载分片合并计划, 并打开其中的文件
+	 * @return
+	 * 计划文件不存在、不属于该原始目录或文件无法打开时返回false
+	 */
+	bool load_shard_plan(int type, const string &pathname,
+			const string &prefix, const string &output, FitsNFPtrVec &vec);
+	/*!
+	 * @brief 写入线程函数: 写入临时文件, 完成后更名
+	 * @param job 写入任务
+	 * @return
+	 * 写入结果
+	 */
+	bool write_job(const out_job &job);
+	/*!
+	 * @brief 将合并后标定图像提交异步写入
+	 * @param type     图像类型
+	 * @param filepath 文件路径
+	 * @return
+	 * 提交结果
+	 */
+	bool write_master(int type, const string &filepath);
+	/*!
+	 * @brief 输出图像为FITS文件
 	 * @param pathname 文件路径
 	 * @param cols     图像宽度
 	 * @param rows     图像高度
+	 * @param mode     输出数据类型
+	 * @param var      逐像素方差. 可为NULL
 	 * @return
 	 * FITS文件指针
 	 */
 	FitsHPtr output_image(float *data, int cols, int rows,
-			const string &pathname);
+			const string &pathname, int mode = OUTPUT_FLOAT,
+			float *var = NULL);
+	/*!
+	 * @brief 计算16位输出的量化参数, 并依据抽样噪声评估量化误差
+	 * @param data 图像数据
+	 * @param n    像素数
+	 * @param qi   量化参数. 误差超限时qi.mode改为OUTPUT_FLOAT
+	 * @param var  逐像素方差. 可为NULL
+	 * @note
+	 * 噪声优先采用逐像素方差中值的平方根, 否则为样本中值绝对偏差的1.4826倍
+	 */
+	void plan_quantize(float *data, int n, quant_info &qi, float *var = NULL);
+	/*!
+	 * @brief 分块量化图像数据并写入文件
+	 * @param fhptr FITS文件
+	 * @param data  图像数据
+	 * @param n     像素数
+	 * @param qi    量化参数. 返回实测量化误差
+	 * @return
+	 * 写入结果
+	 */
+	bool write_quantized(FitsHPtr fhptr, float *data, int n, quant_info &qi);
 	/*!
 	 * @brief 基于样本, 计算图像数据归一化比例尺
+	 * @note
+	 * 样本中值, 剔除NaN和Inf. 无有效样本时返回-1
 	 */
 	float normal_scale(FitsHPtr fhptr);
 	float normal_scale(float *data, int n);
+	/*!
+	 * @brief 等间距抽样行, 在各行内等间距抽样像素
+	 * @param fhptr   FITS文件
+	 * @param nrow    抽样行数
+	 * @param samples 样本
+	 * @return
+	 * 样本数量. 抽样失败或无有效样本时返回0
+	 * @note
+	 * - 仅需缓存一行数据和样本
+	 * - 样本不含NaN和Inf
+	 */
+	int sample_pixels(FitsHPtr fhptr, int nrow, fltarr &samples);
+	/*!
+	 * @brief 逐行抽样, 计算图像数据归一化比例尺
+	 * @param fhptr FITS文件
+	 * @param nrow  抽样行数
+	 * @return
+	 * 抽样中值
+	 * @note
+	 * 仅需缓存一行数据和样本
+	 */
+	float normal_scale(FitsHPtr fhptr, int nrow);
 	/*!
 	 * @brief 卷积滤波
 	 * @param x 卷积核
@@ -156,20 +1025,50 @@ protected:
 	 * @brief 使用min-max计算均值
 	 * @param x  待统计数据
 	 * @param n  数据长度
+	 * @param var   统计结果的方差. 可为NULL
+	 * @param nkeep 参与统计的数据个数. 可为NULL
 	 * @return
 	 * 统计结果
+	 * @note
+	 * - 先剔除NaN和Inf, 保留数据前移. nkeep不含被剔除的数据
+	 * - 有效数据 == 3时结果为中值, 方差为全部数据样本方差的π/2倍除以n
+	 * - 有效数据 < 3时不剔除极值, 取均值; 无有效数据时结果和方差为NaN
+	 */
+	float minmax_clip(float *x, int n, float *var = NULL, int *nkeep = NULL);
+	/*!
+	 * @brief 剔除非有限值(NaN/Inf), 有效数据前移
+	 * @param x 数据
+	 * @param n 数据长度
+	 * @return
+	 * 有效数据个数
+	 */
+	int pack_finite(float *x, int n);
+	/*!
+	 * @brief 由保留数据的和与平方和计算均值的方差
+	 * @param sum 保留数据之和
+	 * @param sq  保留数据平方和
+	 * @param k   保留数据个数
+	 * @return
+	 * 均值的方差. k < 2时为0
 	 */
-	float minmax_clip(float *x, int n);
+	float clip_variance(double sum, double sq, int k);
 	/*!
 	 * @brief 基于信噪比的筛选统计
 	 * @param x      待统计数据
 	 * @param n      数据长度
 	 * @param lsigma 下限信噪比
 	 * @param hsigma 上限信噪比
+	 * @param var    统计结果的方差. 可为NULL
+	 * @param nkeep  参与统计的数据个数. 可为NULL
 	 * @return
 	 * 统计结果
+	 * @note
+	 * - 先剔除NaN和Inf, nkeep不含被剔除的数据
+	 * - 方差为保留数据的样本方差除以保留个数, 即均值的方差
+	 * - 有效数据 <= 3时不足以估计离散度, 改用minmax_clip()
 	 */
-	float avsigclip(float *x, int n, float lsigma = 3.0, float hsigma = 3.0);
+	float avsigclip(float *x, int n, float lsigma = 3.0, float hsigma = 3.0,
+			float *var = NULL, int *nkeep = NULL);
 	/*!
 	 * @brief 使用坏像素周边5*5范围内其它数据替代该值
 	 * @param x    数据存储区
@@ -179,8 +1078,11 @@ protected:
 	void remove_noise(float *x, int cols, int rows);
 	/*!
 	 * @brief 计算临近5*5的平均值
+	 * @param x    临近各行数据的起始地址. x[2]对应row行, 超出图像范围的行为NULL
+	 * @param col  列编号
+	 * @param cols 列数
 	 */
-	float av_replace(float *x, int col, int row, int cols, int rows);
+	float av_replace(float *x[], int col, int cols);
 	/*!
 	 * @brief 加载坏像素
 	 * @param filepath 坏像素记录文件
@@ -188,16 +1090,45 @@ protected:
 	bool load_badpixel(const string &filepath);
 	/*!
 	 * @brief 图像预处理
+	 * @param data    图像区域数据
+	 * @param x0      区域起始列
+	 * @param y0      区域起始行
+	 * @param width   区域宽度
+	 * @param height  区域高度
+	 * @param exptime 曝光时间
+	 * @param mask    宇宙线标记. 为NULL时不修复
+	 * @param weight  权重存储区, 长度同data. 为NULL时不计算
 	 * @note
 	 * - 减本底
 	 * - 减暗场
 	 * - 除平场
+	 * - 修复宇宙线
+	 * - 权重: 由原始数据计算读出噪声和泊松噪声, 叠加标定图像方差后按改正式传递
+	 * - 使用标定图像的对应区域. 整幅图像为(0, 0, wdim, hdim)
+	 */
+	void pre_process(float *data, int x0, int y0, int width, int height,
+			float exptime, const CosmicMask *mask = NULL, float *weight = NULL);
+	/*!
+	 * @brief 线程函数: 识别一个分块中的宇宙线
+	 * @param ctx     宇宙线识别上下文
+	 * @param itile   分块序号
+	 * @param ithread 线程序号. 选择ctx中本线程的缓存区
+	 * @return
+	 * 识别结果
+	 */
+	bool cosmic_tile(cosmic_ctx *ctx, int itile, int ithread);
+	/*!
+	 * @brief 按给定内存规划识别图像区域中的宇宙线. 参数同DetectCosmic()
+	 * @param plan 内存规划. 已由share_memory()分配预算
 	 */
-	void pre_process();
+	int detect_cosmic(const float *data, int x0, int y0, int width,
+			int height, float exptime, CosmicMask &mask, mem_plan plan);
 	/*!
-	 * @brief 处理图像. 提取图像中目标
+	 * @brief 按给定内存规划就地定标图像. 参数同CalibrateFrame()
+	 * @param plan 内存规划. 已由share_memory()分配预算
 	 */
-	void do_process();
+	int calibrate_frame(float *data, int cols, int rows, float exptime,
+			float *weight, const mem_plan &plan);
 };
 //////////////////////////////////////////////////////////////////////////////
 } /* namespace AstroUtil */
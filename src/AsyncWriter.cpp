@@ -0,0 +1,103 @@
+/*
+ * @file AsyncWriter.cpp 异步文件写入接口
+ */
+#include <boost/bind/bind.hpp>
+#include <exception>
+#include "AsyncWriter.h"
+
+namespace AstroUtil {
+//////////////////////////////////////////////////////////////////////////////
+AsyncWriter::AsyncWriter() {
+	capacity_ = 2;
+	busy_ = 0;
+	stop_ = false;
+}
+
+AsyncWriter::~AsyncWriter() {
+	if (thrd_.unique()) {
+		{
+			boost::mutex::scoped_lock lck(mtx_);
+			stop_ = true;
+			cv_.notify_all();
+		}
+		thrd_->join();
+	}
+}
+
+void AsyncWriter::SetHandler(const WriteFunc &func) {
+	boost::mutex::scoped_lock lck(mtx_);
+	func_ = func;
+}
+
+void AsyncWriter::SetCapacity(int n) {
+	boost::mutex::scoped_lock lck(mtx_);
+	capacity_ = n < 1 ? 1 : n;
+	cv_.notify_all();
+}
+
+int AsyncWriter::Capacity() {
+	boost::mutex::scoped_lock lck(mtx_);
+	return capacity_;
+}
+
+bool AsyncWriter::Submit(const out_job &job) {
+	boost::mutex::scoped_lock lck(mtx_);
+	if (func_.empty())
+		return false;
+	if (!thrd_.unique())
+		thrd_.reset(new boost::thread(boost::bind(&AsyncWriter::thread_write,
+				this)));
+	while (int(queue_.size()) >= capacity_)
+		cv_.wait(lck);
+	queue_.push_back(job);
+	cv_.notify_all();
+	return true;
+}
+
+bool AsyncWriter::Flush(std::vector<string> *failed) {
+	boost::mutex::scoped_lock lck(mtx_);
+	bool ok;
+
+	while (queue_.size() || busy_)
+		cv_.wait(lck);
+	ok = failed_.empty();
+	if (failed)
+		failed->insert(failed->end(), failed_.begin(), failed_.end());
+	failed_.clear();
+	return ok;
+}
+
+void AsyncWriter::thread_write() {
+	boost::mutex::scoped_lock lck(mtx_);
+	bool ok;
+
+	while (true) {
+		if (queue_.empty()) {
+			if (stop_)
+				break;
+			cv_.wait(lck);
+			continue;
+		}
+		out_job job = queue_.front();
+		queue_.pop_front();
+		++busy_;
+		cv_.notify_all();
+
+		lck.unlock();
+		try {
+			ok = func_(job);
+		}
+		catch(std::exception &) {// 含内存不足及文件系统错误
+			ok = false;
+		}
+		job.data.reset(); // 缓存区归还池中
+		lck.lock();
+
+		if (!ok)
+			failed_.push_back(job.filepath);
+		--busy_;
+		cv_.notify_all();
+	}
+}
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
@@ -0,0 +1,142 @@
+/*
+ * @file AsyncWriter.h 异步文件写入接口
+ * @version 0.1
+ * @author Xiaomeng Lu
+ * @note
+ * - 计算线程提交已完成的数据缓存区及头关键字, 由独立线程写入文件
+ * - 队列容量有限, 队列满时提交阻塞, 限制待写入数据占用的内存
+ * - 写入完成后释放缓存区引用, 缓存区归还数据缓存区池
+ * - 记录写入失败的文件, 由Flush()返回. 提交成功仅表示任务已入队
+ */
+
+#ifndef ASYNCWRITER_H_
+#define ASYNCWRITER_H_
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <deque>
+#include <vector>
+#include <string>
+#include "BufferPool.h"
+
+using std::string;
+
+namespace AstroUtil {
+//////////////////////////////////////////////////////////////////////////////
+struct out_key {	//< 头关键字
+	string keyword;	//< 关键字名称
+	int datatype;	//< 数据类型: TINT/TFLOAT/TDOUBLE/TSTRING
+	double value;	//< 数值
+	string text;	//< 字符串
+	string comment;	//< 注释
+};
+
+struct out_ext {	//< 图像扩展. 尺寸与主图像相同
+	string extname;	//< 扩展名
+	int bitpix;		//< 像素数据位数
+	fltarr data;	//< 图像数据
+};
+
+struct out_job {	//< 写入任务
+	string filepath;	//< 文件路径. 先写入filepath.<pid>.tmp, 完成后更名
+	fltarr data;		//< 图像数据
+	int cols, rows;		//< 图像尺寸
+	int mode;			//< 输出数据类型
+	std::vector<string> cards;	//< 原始文件头记录. 先于keys写入
+	std::vector<out_key> keys;	//< 头关键字. 覆盖同名记录
+	std::vector<out_ext> exts;	//< 图像扩展. 总是以原始精度写入
+
+public:
+	void AddKey(const string &keyword, int datatype, double value,
+			const string &comment) {
+		out_key key;
+		key.keyword = keyword;
+		key.datatype = datatype;
+		key.value = value;
+		key.comment = comment;
+		keys.push_back(key);
+	}
+
+	void AddKey(const string &keyword, const string &text,
+			const string &comment) {
+		out_key key;
+		key.keyword = keyword;
+		key.datatype = -1;
+		key.value = 0.0;
+		key.text = text;
+		key.comment = comment;
+		keys.push_back(key);
+	}
+
+	void AddExt(const string &extname, int bitpix, fltarr data) {
+		out_ext ext;
+		ext.extname = extname;
+		ext.bitpix = bitpix;
+		ext.data = data;
+		exts.push_back(ext);
+	}
+};
+
+class AsyncWriter {
+public:
+	AsyncWriter();
+	virtual ~AsyncWriter();
+
+public:
+	typedef boost::function<bool (const out_job&)> WriteFunc;	//< 写入函数
+
+protected:
+	WriteFunc func_;	//< 写入函数
+	int capacity_;		//< 队列容量
+	std::deque<out_job> queue_;	//< 待写入任务
+	int busy_;			//< 写入中任务数
+	std::vector<string> failed_;	//< 自上次Flush()以来写入失败的文件
+	bool stop_;			//< 停止标志
+	boost::shared_ptr<boost::thread> thrd_;	//< 写入线程
+	boost::mutex mtx_;	//< 互斥锁
+	boost::condition_variable cv_;	//< 状态变更通知
+
+protected:
+	/*!
+	 * @brief 线程函数: 循环写入队列中的任务
+	 */
+	void thread_write();
+
+public:
+	/*!
+	 * @brief 设置写入函数
+	 */
+	void SetHandler(const WriteFunc &func);
+	/*!
+	 * @brief 设置队列容量
+	 * @param n 队列容量. 最小为1
+	 */
+	void SetCapacity(int n);
+	/*!
+	 * @brief 查询队列容量
+	 */
+	int Capacity();
+	/*!
+	 * @brief 提交写入任务
+	 * @param job 写入任务
+	 * @return
+	 * 提交结果. 未设置写入函数时返回false
+	 * @note
+	 * - 队列满时阻塞
+	 * - 首次提交时启动写入线程. 因此fork()前不应提交任务
+	 */
+	bool Submit(const out_job &job);
+	/*!
+	 * @brief 等待队列中的任务全部写入
+	 * @param failed 自上次调用以来写入失败的文件路径, 追加至末尾. 可为NULL
+	 * @return
+	 * 自上次调用以来的任务是否均写入成功
+	 */
+	bool Flush(std::vector<string> *failed = NULL);
+};
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
+
+#endif /* ASYNCWRITER_H_ */
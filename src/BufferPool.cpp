@@ -0,0 +1,199 @@
+/*
+ * @file BufferPool.cpp 数据缓存区池
+ */
+#include <boost/thread/mutex.hpp>
+#include <stdlib.h>
+#include <new>
+#include <sys/mman.h>
+#include <map>
+#include "BufferPool.h"
+
+using namespace std;
+
+namespace AstroUtil {
+// 缓存区对齐字节数
+const size_t POOL_ALIGN = 64;
+// 缓存区容量取整单位, 量纲: 字节
+const size_t POOL_GRAIN = 4096;
+// 大页内存阈值, 量纲: 字节
+const size_t HUGEPAGE_BYTES = 2 * 1024 * 1024;
+
+struct pool_core {
+	boost::mutex mtx;	//< 互斥锁
+	multimap<size_t, void*> idle;	//< 空闲缓存区: 容量-地址
+	map<void*, size_t> mapped;		//< 以mmap申请的缓存区: 地址-容量
+	size_t limit;		//< 池持有内存上限
+	bool hugepage;		//< 使用大页内存
+	pool_stats stats;	//< 统计信息
+
+public:
+	pool_core() {
+		limit = 0;
+		hugepage = false;
+		stats.requests = stats.allocs = stats.reuses = 0;
+		stats.held = stats.inuse = stats.peak = 0;
+	}
+
+	virtual ~pool_core() {
+		trim();
+	}
+
+	/*!
+	 * @brief 向系统申请内存
+	 */
+	void *allocate(size_t bytes) {
+		void *ptr(NULL);
+#ifdef MADV_HUGEPAGE
+		if (hugepage && bytes >= HUGEPAGE_BYTES) {
+			ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr == MAP_FAILED)
+				ptr = NULL;
+			else {
+				madvise(ptr, bytes, MADV_HUGEPAGE);
+				mapped[ptr] = bytes;
+				return ptr;
+			}
+		}
+#endif
+		if (posix_memalign(&ptr, POOL_ALIGN, bytes))
+			ptr = NULL;
+		return ptr;
+	}
+
+	/*!
+	 * @brief 释放全部空闲缓存区. 调用前已锁定mtx
+	 */
+	void trim() {
+		for (multimap<size_t, void*>::iterator it = idle.begin();
+				it != idle.end(); ++it) {
+			release(it->second, it->first);
+			stats.held -= it->first;
+		}
+		idle.clear();
+	}
+
+	/*!
+	 * @brief 由大到小释放空闲缓存区, 直至持有内存不超过bytes. 调用前已锁定mtx
+	 */
+	void trim(size_t bytes) {
+		while (stats.held > bytes && idle.size()) {
+			multimap<size_t, void*>::iterator it = --idle.end();
+			release(it->second, it->first);
+			stats.held -= it->first;
+			idle.erase(it);
+		}
+	}
+
+	/*!
+	 * @brief 向系统释放内存
+	 */
+	void release(void *ptr, size_t bytes) {
+		map<void*, size_t>::iterator it = mapped.find(ptr);
+		if (it != mapped.end()) {
+			munmap(ptr, bytes);
+			mapped.erase(it);
+		} else
+			free(ptr);
+	}
+};
+
+/*
+ * 缓存区删除器: 将缓存区归还池中
+ */
+class pool_deleter {
+protected:
+	PoolCorePtr core_;	//< 池数据
+	size_t bytes_;		//< 缓存区容量
+
+public:
+	pool_deleter(PoolCorePtr core, size_t bytes) {
+		core_ = core;
+		bytes_ = bytes;
+	}
+
+	void operator()(float *ptr) {
+		boost::mutex::scoped_lock lck(core_->mtx);
+		pool_stats &stats = core_->stats;
+		stats.inuse -= bytes_;
+		if (core_->limit && stats.held > core_->limit) {
+			core_->release(ptr, bytes_);
+			stats.held -= bytes_;
+		} else
+			core_->idle.insert(pair<size_t, void*>(bytes_, ptr));
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////////
+BufferPool::BufferPool() {
+	core_ = boost::make_shared<pool_core>();
+}
+
+BufferPool::~BufferPool() {
+}
+
+fltarr BufferPool::Alloc(size_t n) {
+	size_t bytes = (n * sizeof(float) + POOL_GRAIN - 1) / POOL_GRAIN
+			* POOL_GRAIN;
+	if (!bytes)
+		bytes = POOL_GRAIN;
+
+	boost::mutex::scoped_lock lck(core_->mtx);
+	pool_stats &stats = core_->stats;
+	multimap<size_t, void*>::iterator it = core_->idle.lower_bound(bytes);
+	void *ptr(NULL);
+
+	++stats.requests;
+	// 复用容量不超过需求1.25倍的空闲缓存区
+	if (it != core_->idle.end() && it->first <= bytes + bytes / 4) {
+		ptr = it->second;
+		bytes = it->first;
+		core_->idle.erase(it);
+		++stats.reuses;
+	} else {
+		// 使用中内存超出上限时拒绝申请, 否则先释放空闲缓存区
+		if (core_->limit) {
+			if (stats.inuse + bytes > core_->limit)
+				throw std::bad_alloc();
+			core_->trim(core_->limit - bytes);
+		}
+		if (!(ptr = core_->allocate(bytes)))
+			throw std::bad_alloc();
+		++stats.allocs;
+		stats.held += bytes;
+		if (stats.peak < stats.held)
+			stats.peak = stats.held;
+	}
+	stats.inuse += bytes;
+
+	return fltarr((float*) ptr, pool_deleter(core_, bytes));
+}
+
+void BufferPool::SetLimit(size_t bytes) {
+	boost::mutex::scoped_lock lck(core_->mtx);
+	core_->limit = bytes;
+	if (bytes)
+		core_->trim(bytes);
+}
+
+void BufferPool::SetHugePage(bool enable) {
+	boost::mutex::scoped_lock lck(core_->mtx);
+	core_->hugepage = enable;
+}
+
+void BufferPool::Trim() {
+	boost::mutex::scoped_lock lck(core_->mtx);
+	core_->trim();
+}
+
+pool_stats BufferPool::Stats() {
+	boost::mutex::scoped_lock lck(core_->mtx);
+	return core_->stats;
+}
+
+void BufferPool::ResetStats() {
+	boost::mutex::scoped_lock lck(core_->mtx);
+	core_->stats.requests = core_->stats.allocs = core_->stats.reuses = 0;
+}
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
@@ -0,0 +1,80 @@
+/*
+ * @file BufferPool.h 数据缓存区池
+ * @version 0.1
+ * @author Xiaomeng Lu
+ * @note
+ * - 缓存区首地址按64字节对齐, 便于向量化访问
+ * - 缓存区释放后归还池中, 后续申请时复用, 避免逐帧申请和释放内存
+ * - 可选使用大页内存. 大于2MB的缓存区以mmap申请, 并建议内核使用透明大页
+ */
+
+#ifndef BUFFERPOOL_H_
+#define BUFFERPOOL_H_
+
+#include <boost/smart_ptr.hpp>
+#include <stddef.h>
+
+namespace AstroUtil {
+//////////////////////////////////////////////////////////////////////////////
+typedef boost::shared_array<float> fltarr;
+
+struct pool_stats {	//< 缓存区池统计信息
+	unsigned long requests;	//< 申请次数
+	unsigned long allocs;	//< 向系统申请内存次数
+	unsigned long reuses;	//< 复用池中缓存区次数
+	size_t held;	//< 池持有内存, 量纲: 字节
+	size_t inuse;	//< 使用中内存, 量纲: 字节
+	size_t peak;	//< 池持有内存峰值, 量纲: 字节
+};
+
+struct pool_core;
+typedef boost::shared_ptr<pool_core> PoolCorePtr;
+
+class BufferPool {
+public:
+	BufferPool();
+	virtual ~BufferPool();
+
+protected:
+	PoolCorePtr core_;	//< 池数据. 由池和各缓存区共享
+
+public:
+	/*!
+	 * @brief 申请缓存区
+	 * @param n 数据长度
+	 * @return
+	 * 缓存区. 引用计数归零时归还池中
+	 * @note
+	 * - 缓存区内容未初始化
+	 * - 使用中内存将超出上限时抛出std::bad_alloc
+	 */
+	fltarr Alloc(size_t n);
+	/*!
+	 * @brief 设置池持有内存上限
+	 * @param bytes 内存上限, 量纲: 字节. 0: 不限制
+	 * @note
+	 * - 池持有内存(使用中及空闲)不超过上限. 超出时先释放空闲缓存区
+	 * - 上限低于使用中内存时, 归还的缓存区直接释放
+	 */
+	void SetLimit(size_t bytes);
+	/*!
+	 * @brief 设置是否使用大页内存
+	 */
+	void SetHugePage(bool enable);
+	/*!
+	 * @brief 释放池中全部空闲缓存区
+	 */
+	void Trim();
+	/*!
+	 * @brief 查询统计信息
+	 */
+	pool_stats Stats();
+	/*!
+	 * @brief 清除申请次数统计
+	 */
+	void ResetStats();
+};
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
+
+#endif /* BUFFERPOOL_H_ */
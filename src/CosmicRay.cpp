@@ -0,0 +1,183 @@
+/*
+ * @file CosmicRay.cpp 单帧宇宙线识别与修复
+ */
+#include <algorithm>
+#include "CosmicRay.h"
+
+using namespace std;
+
+namespace AstroUtil {
+//////////////////////////////////////////////////////////////////////////////
+static inline int clampi(int v, int lo, int hi) {
+	return v < lo ? lo : (v > hi ? hi : v);
+}
+
+/*
+ * 比较交换: 使a <= b
+ */
+static inline void sort2(float &a, float &b) {
+	float t = min(a, b);
+	b = max(a, b);
+	a = t;
+}
+
+static inline float med3(float a, float b, float c) {
+	return max(min(a, b), min(max(a, b), c));
+}
+
+/*
+ * 固定长度中值比较网络(Devillard, Fast median search)
+ */
+template <int K> static inline float med_k(float *p);
+
+template <> inline float med_k<5>(float *p) {
+	sort2(p[0], p[1]); sort2(p[3], p[4]); sort2(p[0], p[3]);
+	sort2(p[1], p[4]); sort2(p[1], p[2]); sort2(p[2], p[3]);
+	sort2(p[1], p[2]);
+	return p[2];
+}
+
+template <> inline float med_k<7>(float *p) {
+	sort2(p[0], p[5]); sort2(p[0], p[3]); sort2(p[1], p[6]);
+	sort2(p[2], p[4]); sort2(p[0], p[1]); sort2(p[3], p[5]);
+	sort2(p[2], p[6]); sort2(p[2], p[3]); sort2(p[3], p[6]);
+	sort2(p[4], p[5]); sort2(p[1], p[4]); sort2(p[1], p[3]);
+	sort2(p[3], p[4]);
+	return p[3];
+}
+
+/*
+ * 一个像素四个子像素的拉普拉斯正值之和
+ */
+static inline float lap_pixel(float v, float l, float r, float u, float d) {
+	float v2 = v + v;
+	return max(v2 - l - u, 0.0f) + max(v2 - r - u, 0.0f)
+			+ max(v2 - l - d, 0.0f) + max(v2 - r - d, 0.0f);
+}
+
+void laplace_plus(const float *img, float *lap, int w, int h) {
+	const float *c, *u, *d;
+	float *o;
+	int x, y;
+
+	for (y = 0; y < h; ++y) {
+		c = img + y * w;
+		u = img + clampi(y - 1, 0, h - 1) * w;
+		d = img + clampi(y + 1, 0, h - 1) * w;
+		o = lap + y * w;
+		for (x = 1; x < w - 1; ++x)
+			o[x] = 0.25f * lap_pixel(c[x], c[x - 1], c[x + 1], u[x], d[x]);
+		o[0] = 0.25f * lap_pixel(c[0], c[0], c[min(1, w - 1)], u[0], d[0]);
+		if (w > 1)
+			o[w - 1] = 0.25f * lap_pixel(c[w - 1], c[w - 2], c[w - 1], u[w - 1],
+					d[w - 1]);
+	}
+}
+
+void median3x3(const float *in, float *out, int w, int h, float *tmp) {
+	float *lo(tmp), *mid(tmp + w), *hi(tmp + 2 * w), *o;
+	const float *a, *b, *c;
+	float s0, s1, t;
+	int x, y, xl, xr;
+
+	for (y = 0; y < h; ++y) {
+		// 逐列排序相邻三行
+		a = in + clampi(y - 1, 0, h - 1) * w;
+		b = in + y * w;
+		c = in + clampi(y + 1, 0, h - 1) * w;
+		for (x = 0; x < w; ++x) {
+			s0 = min(a[x], b[x]);
+			s1 = max(a[x], b[x]);
+			lo[x] = min(s0, c[x]);
+			t = max(s0, c[x]);
+			mid[x] = min(s1, t);
+			hi[x] = max(s1, t);
+		}
+		// 九个数的中值 = 中值(最小值的最大值, 中值的中值, 最大值的最小值)
+		o = out + y * w;
+		for (x = 1; x < w - 1; ++x) {
+			o[x] = med3(max(max(lo[x - 1], lo[x]), lo[x + 1]),
+					med3(mid[x - 1], mid[x], mid[x + 1]),
+					min(min(hi[x - 1], hi[x]), hi[x + 1]));
+		}
+		for (x = 0; x < w; x += max(w - 1, 1)) {
+			xl = clampi(x - 1, 0, w - 1);
+			xr = clampi(x + 1, 0, w - 1);
+			o[x] = med3(max(max(lo[xl], lo[x]), lo[xr]),
+					med3(mid[xl], mid[x], mid[xr]),
+					min(min(hi[xl], hi[x]), hi[xr]));
+		}
+	}
+}
+
+template <int K>
+static void median_sep_k(const float *in, float *out, int w, int h,
+		float *tmp) {
+	const int r = K / 2;
+	const float *rp[K], *t;
+	float p[K], *o;
+	int x, y, k, xe;
+
+	// 逐列
+	for (y = 0; y < h; ++y) {
+		for (k = 0; k < K; ++k)
+			rp[k] = in + clampi(y + k - r, 0, h - 1) * w;
+		o = tmp + y * w;
+		for (x = 0; x < w; ++x) {
+			for (k = 0; k < K; ++k)
+				p[k] = rp[k][x];
+			o[x] = med_k<K>(p);
+		}
+	}
+	// 逐行. 边界列以边缘值补齐
+	xe = min(r, w);
+	for (y = 0; y < h; ++y) {
+		t = tmp + y * w;
+		o = out + y * w;
+		for (x = r; x < w - r; ++x) {
+			for (k = 0; k < K; ++k)
+				p[k] = t[x + k - r];
+			o[x] = med_k<K>(p);
+		}
+		for (x = 0; x < w; ++x) {
+			if (x == xe && (x = max(w - r, xe)) >= w)
+				break;
+			for (k = 0; k < K; ++k)
+				p[k] = t[clampi(x + k - r, 0, w - 1)];
+			o[x] = med_k<K>(p);
+		}
+	}
+}
+
+void median_sep(const float *in, float *out, int w, int h, int size,
+		float *tmp) {
+	if (size == 7)
+		median_sep_k<7>(in, out, w, h, tmp);
+	else
+		median_sep_k<5>(in, out, w, h, tmp);
+}
+
+void repair_cosmic(float *data, int x0, int y0, int width, int height,
+		const CosmicMask &mask) {
+	float near[24];
+	int i, j, r, c, n;
+
+	for (i = 0; i < height; ++i) {
+		for (j = 0; j < width; ++j) {
+			if (!mask.Test(x0 + j, y0 + i))
+				continue;
+			for (r = max(i - 2, 0), n = 0; r <= min(i + 2, height - 1); ++r) {
+				for (c = max(j - 2, 0); c <= min(j + 2, width - 1); ++c) {
+					if (!mask.Test(x0 + c, y0 + r))
+						near[n++] = data[r * width + c];
+				}
+			}
+			if (n) {
+				nth_element(near, near + n / 2, near + n);
+				data[i * width + j] = near[n / 2];
+			}
+		}
+	}
+}
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
@@ -0,0 +1,131 @@
+/*
+ * @file CosmicRay.h 单帧宇宙线识别与修复
+ * @version 0.1
+ * @author Xiaomeng Lu
+ * @note
+ * - 识别算法参照L.A.Cosmic(van Dokkum 2001): 2倍细分拉普拉斯边缘、中值滤波噪声模型
+ *   及精细结构图像区分宇宙线与恒星. 单次执行, 不迭代
+ * - 滤波核逐行以min/max比较网络实现, 便于编译器向量化. 3x3中值为精确值,
+ *   5x5和7x7中值以行/列两次一维中值近似
+ * - 宇宙线以位图记录, 每像素1位
+ */
+
+#ifndef COSMICRAY_H_
+#define COSMICRAY_H_
+
+#include <vector>
+
+namespace AstroUtil {
+//////////////////////////////////////////////////////////////////////////////
+class CosmicMask {
+public:
+	CosmicMask() {
+		x0_ = y0_ = width_ = height_ = stride_ = 0;
+	}
+
+protected:
+	int x0_, y0_;			//< 区域起始位置
+	int width_, height_;	//< 区域尺寸
+	int stride_;			//< 每行字数
+	std::vector<unsigned int> bits_;	//< 位图. 每字32像素
+
+public:
+	/*!
+	 * @brief 计算覆盖区域所需的位图内存, 量纲: 字节
+	 * @param width  区域宽度
+	 * @param height 区域高度
+	 */
+	static size_t Bytes(int width, int height) {
+		return size_t((width + 31) / 32) * height * sizeof(unsigned int);
+	}
+	/*!
+	 * @brief 清除标记, 并设置覆盖区域
+	 * @param x0     区域起始列
+	 * @param y0     区域起始行
+	 * @param width  区域宽度
+	 * @param height 区域高度
+	 */
+	void Reset(int x0, int y0, int width, int height) {
+		x0_ = x0;
+		y0_ = y0;
+		width_ = width;
+		height_ = height;
+		stride_ = (width + 31) / 32;
+		bits_.assign(stride_ * height, 0);
+	}
+	/*!
+	 * @brief 标记像素. 位置为图像绝对位置, 须位于区域内
+	 * @note
+	 * 多线程写入时, 各线程负责的列范围相对区域起始列须按32列对齐
+	 */
+	void Set(int x, int y) {
+		x -= x0_;
+		y -= y0_;
+		bits_[y * stride_ + (x >> 5)] |= 1U << (x & 31);
+	}
+	/*!
+	 * @brief 检查像素是否被标记. 位置为图像绝对位置, 区域外返回false
+	 */
+	bool Test(int x, int y) const {
+		x -= x0_;
+		y -= y0_;
+		return x >= 0 && x < width_ && y >= 0 && y < height_
+				&& (bits_[y * stride_ + (x >> 5)] >> (x & 31) & 1);
+	}
+	/*!
+	 * @brief 统计被标记像素数
+	 */
+	int Count() const {
+		int n(0);
+		for (std::vector<unsigned int>::const_iterator it = bits_.begin();
+				it != bits_.end(); ++it)
+			n += __builtin_popcount(*it);
+		return n;
+	}
+};
+
+/*!
+ * @brief 计算2倍细分后拉普拉斯算子的正值部分, 再合并回原分辨率
+ * @param img 图像
+ * @param lap 结果
+ * @param w   宽度
+ * @param h   高度
+ * @note
+ * 细分后各子像素与相邻像素的差值可直接由原图像计算, 无需构建细分图像
+ */
+void laplace_plus(const float *img, float *lap, int w, int h);
+/*!
+ * @brief 3x3中值滤波
+ * @param in  图像
+ * @param out 结果
+ * @param w   宽度
+ * @param h   高度
+ * @param tmp 临时缓存区. 长度不小于3*w
+ */
+void median3x3(const float *in, float *out, int w, int h, float *tmp);
+/*!
+ * @brief 可分离近似中值滤波: 先逐列再逐行一维中值
+ * @param in   图像
+ * @param out  结果
+ * @param w    宽度
+ * @param h    高度
+ * @param size 滤波器尺寸, 5或7
+ * @param tmp  临时缓存区. 长度不小于w*h
+ */
+void median_sep(const float *in, float *out, int w, int h, int size,
+		float *tmp);
+/*!
+ * @brief 以5x5范围内未标记像素的中值替换被标记像素
+ * @param data   图像区域数据
+ * @param x0     区域起始列
+ * @param y0     区域起始行
+ * @param width  区域宽度
+ * @param height 区域高度
+ * @param mask   宇宙线标记. 位置为图像绝对位置
+ */
+void repair_cosmic(float *data, int x0, int y0, int width, int height,
+		const CosmicMask &mask);
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
+
+#endif /* COSMICRAY_H_ */
@@ -0,0 +1,111 @@
+/*
+ * @file FFTCorr.cpp 基于FFT的图像互相关
+ */
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "FFTCorr.h"
+
+using namespace std;
+
+namespace AstroUtil {
+//////////////////////////////////////////////////////////////////////////////
+/*
+ * 原位一维FFT. 数据间隔为stride
+ */
+static void fft1d(cplx *x, int n, int stride, bool inverse) {
+	int i, j, k, len;
+	// 位反转重排
+	for (i = 1, j = 0; i < n; ++i) {
+		for (k = n >> 1; j & k; k >>= 1)
+			j ^= k;
+		j ^= k;
+		if (i < j)
+			swap(x[i * stride], x[j * stride]);
+	}
+	// 蝶形运算
+	for (len = 2; len <= n; len <<= 1) {
+		double ang = 2.0 * M_PI / len * (inverse ? 1 : -1);
+		cplx wlen(cos(ang), sin(ang));
+		for (i = 0; i < n; i += len) {
+			cplx w(1.0);
+			for (j = 0; j < len / 2; ++j) {
+				cplx u = x[(i + j) * stride];
+				cplx v = x[(i + j + len / 2) * stride] * w;
+				x[(i + j) * stride] = u + v;
+				x[(i + j + len / 2) * stride] = u - v;
+				w *= wlen;
+			}
+		}
+	}
+}
+
+int fft_size(int n) {
+	int m = 1;
+	while (m < n)
+		m <<= 1;
+	return m;
+}
+
+void fft2d(cplx *x, int w, int h, bool inverse) {
+	int i;
+	for (i = 0; i < h; ++i)
+		fft1d(x + i * w, w, 1, inverse);
+	for (i = 0; i < w; ++i)
+		fft1d(x + i, h, w, inverse);
+}
+
+void make_spectrum(const float *img, int w, int h, int nw, int nh, cplx *spec) {
+	double mean(0.0);
+	int i, j;
+
+	for (i = 0; i < w * h; ++i)
+		mean += img[i];
+	mean /= w * h;
+	fill(spec, spec + nw * nh, cplx(0.0));
+	for (j = 0; j < h; ++j) {
+		for (i = 0; i < w; ++i)
+			spec[j * nw + i] = img[j * w + i] - mean;
+	}
+	fft2d(spec, nw, nh, false);
+}
+
+double xcorr_peak(const cplx *ref, cplx *spec, int nw, int nh, double &dx,
+		double &dy) {
+	int n(nw * nh), i, px(0), py(0), xl, xr, yl, yr;
+	double peak, mean(0.0), v, c0, cl, cr;
+
+	for (i = 0; i < n; ++i)
+		spec[i] = conj(ref[i]) * spec[i];
+	fft2d(spec, nw, nh, true);
+	// 峰值
+	peak = spec[0].real();
+	for (i = 0; i < n; ++i) {
+		mean += (v = spec[i].real());
+		if (v > peak) {
+			peak = v;
+			px = i % nw;
+			py = i / nw;
+		}
+	}
+	mean /= n;
+	// 抛物线拟合亚像素位置. 互相关为循环相关, 邻点按周期取值
+	xl = (px + nw - 1) % nw;
+	xr = (px + 1) % nw;
+	yl = (py + nh - 1) % nh;
+	yr = (py + 1) % nh;
+	c0 = peak;
+	cl = spec[py * nw + xl].real();
+	cr = spec[py * nw + xr].real();
+	dx = px > nw / 2 ? px - nw : px;
+	if ((v = cl - 2.0 * c0 + cr) < 0.0)
+		dx += 0.5 * (cl - cr) / v;
+	cl = spec[yl * nw + px].real();
+	cr = spec[yr * nw + px].real();
+	dy = py > nh / 2 ? py - nh : py;
+	if ((v = cl - 2.0 * c0 + cr) < 0.0)
+		dy += 0.5 * (cl - cr) / v;
+	return (peak - mean) / n;
+}
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
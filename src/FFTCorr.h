@@ -0,0 +1,61 @@
+/*
+ * @file FFTCorr.h 基于FFT的图像互相关
+ * @version 0.1
+ * @author Xiaomeng Lu
+ * @note
+ * - 基2 FFT, 图像补零至2的幂
+ * - 参考图像频谱计算一次, 与各图像频谱共轭相乘后逆变换, 峰值位置即偏移量
+ */
+
+#ifndef FFTCORR_H_
+#define FFTCORR_H_
+
+#include <complex>
+
+namespace AstroUtil {
+//////////////////////////////////////////////////////////////////////////////
+typedef std::complex<double> cplx;
+
+/*!
+ * @brief 计算不小于n的2的幂
+ */
+int fft_size(int n);
+/*!
+ * @brief 原位二维FFT
+ * @param x       数据, 行优先存储
+ * @param w       宽度, 2的幂
+ * @param h       高度, 2的幂
+ * @param inverse 逆变换. 逆变换结果未除以w*h
+ */
+void fft2d(cplx *x, int w, int h, bool inverse);
+/*!
+ * @brief 计算图像频谱
+ * @param img  图像数据
+ * @param w    图像宽度
+ * @param h    图像高度
+ * @param nw   频谱宽度, 2的幂且不小于w
+ * @param nh   频谱高度, 2的幂且不小于h
+ * @param spec 频谱
+ * @note
+ * 图像扣除均值后补零
+ */
+void make_spectrum(const float *img, int w, int h, int nw, int nh, cplx *spec);
+/*!
+ * @brief 由频谱计算互相关峰值位置
+ * @param ref  参考图像频谱
+ * @param spec 图像频谱. 计算后内容被覆盖
+ * @param nw   频谱宽度
+ * @param nh   频谱高度
+ * @param dx   图像相对参考图像的列偏移
+ * @param dy   图像相对参考图像的行偏移
+ * @return
+ * 峰值与均值之差. <= 0时无有效峰值
+ * @note
+ * 峰值位置以抛物线拟合至亚像素. 偏移满足img(x) = ref(x - d)
+ */
+double xcorr_peak(const cplx *ref, cplx *spec, int nw, int nh, double &dx,
+		double &dy);
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
+
+#endif /* FFTCORR_H_ */
@@ -2,13 +2,45 @@
  * @brief FitsHandler.cpp 基于cfitsio的FITS文件访问接口
  */
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <boost/thread/recursive_mutex.hpp>
 #include "FitsHandler.h"
 
+using namespace std;
+
 namespace AstroUtil {
+// cfitsio是否为可重入编译. 否则各线程串行访问
+static const bool FITS_REENTRANT = fits_is_reentrant() != 0;
+// 串行访问cfitsio的互斥锁. 允许同一线程嵌套加锁
+static boost::recursive_mutex mtx_fits;
+// 读取图像时替换空值的数值
+const float NULL_PIXEL = NAN;
+
+//////////////////////////////////////////////////////////////////////////////
+FitsLock::FitsLock() {
+	if ((locked_ = !FITS_REENTRANT))
+		mtx_fits.lock();
+}
+
+FitsLock::~FitsLock() {
+	if (locked_)
+		mtx_fits.unlock();
+}
+
+bool FitsLock::Reentrant() {
+	return FITS_REENTRANT;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 FitsHandler::FitsHandler() {
 	fileptr_ = NULL;
 	rows_ = cols_ = 0;
+	trim_ = false;
+	fcols_ = frows_ = x0_ = y0_ = 0;
+	pool_ = NULL;
+	mrow0_ = mrow1_ = bx0_ = bcols_ = half_ = 0;
 }
 
 FitsHandler::~FitsHandler() {
@@ -16,11 +48,18 @@ FitsHandler::~FitsHandler() {
 }
 
 void FitsHandler::close() {
+	FitsLock lck;
 	if (fileptr_) {
 		int status(0);
 		fits_close_file(fileptr_, &status);
 		fileptr_ = NULL;
 	}
+	trim_ = false;
+	median_.reset();
+}
+
+fltarr FitsHandler::alloc(size_t n) {
+	return pool_ ? pool_->Alloc(n) : fltarr(new float[n]);
 }
 
 void FitsHandler::fill_errmsg(int code) {
@@ -33,6 +72,7 @@ fitsfile *FitsHandler::operator()() {
 }
 
 bool FitsHandler::Open(const char *filepath) {
+	FitsLock lck;
 	close();
 	// 尝试打开文件
 	int status(0);
@@ -45,15 +85,30 @@ bool FitsHandler::Open(const char *filepath) {
 		sprintf(name, "NAXIS%d", j);
 		fits_read_key(fileptr_, TINT, name, naxes + i, NULL, &status);
 	}
-	cols_ = naxes[0];
-	rows_ = naxes[1];
+	cols_ = fcols_ = naxes[0];
+	rows_ = frows_ = naxes[1];
+	x0_ = y0_ = 0;
 
 	fill_errmsg(status);
 	return status == 0;
 }
 
+bool FitsHandler::Close() {
+	FitsLock lck;
+	int status(0);
+	if (fileptr_) {
+		fits_close_file(fileptr_, &status);
+		fileptr_ = NULL;
+		fill_errmsg(status);
+	}
+	trim_ = false;
+	median_.reset();
+	return status == 0;
+}
+
 bool FitsHandler::CreateImage(const char *filepath, int bitpix, int width,
 		int height) {
+	FitsLock lck;
 	close();
 	// 尝试创建文件
 	int status(0);
@@ -70,12 +125,160 @@ bool FitsHandler::CreateImage(const char *filepath, int bitpix, int width,
 	return status == 0;
 }
 
+bool FitsHandler::AppendImage(const char *extname, int bitpix) {
+	FitsLock lck;
+	if (!fileptr_)
+		return false;
+	int status(0);
+	long naxes[] = { cols_, rows_ };
+
+	fits_create_img(fileptr_, bitpix, 2, naxes, &status);
+	fits_write_key(fileptr_, TSTRING, "EXTNAME", (void*) extname, NULL,
+			&status);
+	fill_errmsg(status);
+	return status == 0;
+}
+
+void FitsHandler::SetPool(BufferPool *pool) {
+	pool_ = pool;
+}
+
+bool FitsHandler::SetOverscan(const string &trimsec, const string &biassec,
+		int smooth) {
+	FitsLock lck;
+	if (!fileptr_ || trim_)
+		return false;
+	string tsec(trimsec), bsec(biassec);
+	char str[FLEN_VALUE];
+	int status(0);
+	int tx0(0), tx1(fcols_), ty0(0), ty1(frows_), bx0, bx1, by0, by1;
+
+	if (tsec.empty()) {
+		fits_read_key(fileptr_, TSTRING, "TRIMSEC", str, NULL, &status);
+		if (!status)
+			tsec = str;
+		status = 0;
+	}
+	if (bsec.empty()) {
+		fits_read_key(fileptr_, TSTRING, "BIASSEC", str, NULL, &status);
+		if (!status)
+			bsec = str;
+		status = 0;
+	}
+	if ((tsec.empty() && bsec.empty())
+			|| (!tsec.empty() && !parse_section(tsec, tx0, tx1, ty0, ty1))
+			|| (!bsec.empty() && !parse_section(bsec, bx0, bx1, by0, by1)))
+		return false;
+
+	int trows(ty1 - ty0), n;
+	median_.reset();
+	mrow0_ = mrow1_ = 0;
+	if (!bsec.empty()) {
+		median_ = alloc(trows);
+		if (by0 <= ty0 && by1 >= ty1) {// 逐行中值, 读取时计算
+			bx0_ = bx0;
+			bcols_ = bx1 - bx0;
+			half_ = smooth > 1 ? smooth / 2 : 0;
+		} else {// 整体中值
+			long fpixel[] = { bx0 + 1, by0 + 1 };
+			long lpixel[] = { bx1, by1 };
+			long inc[] = { 1, 1 };
+			fltarr buff = alloc((bx1 - bx0) * (by1 - by0));
+			float *x = buff.get();
+
+			fits_read_subset(fileptr_, TFLOAT, fpixel, lpixel, inc, NULL, x,
+					NULL, &status);
+			if (status) {
+				median_.reset();
+				fill_errmsg(status);
+				return false;
+			}
+			n = (bx1 - bx0) * (by1 - by0);
+			nth_element(x, x + n / 2, x + n);
+			fill(median_.get(), median_.get() + trows, x[n / 2]);
+			mrow1_ = trows;
+			half_ = 0;
+		}
+	}
+	trim_ = true;
+	x0_ = tx0;
+	y0_ = ty0;
+	cols_ = tx1 - tx0;
+	rows_ = trows;
+	return true;
+}
+
+bool FitsHandler::SkyToPixel(double ra, double dec, double &x, double &y) {
+	FitsLock lck;
+	if (!fileptr_)
+		return false;
+	const double D2R = M_PI / 180.0;
+	int status(0), status1(0);
+	char ctype[FLEN_VALUE];
+	double crval1, crval2, crpix1, crpix2;
+	double cd11, cd12, cd21, cd22, cdelt1, cdelt2, crota(0.0);
+
+	fits_read_key(fileptr_, TSTRING, "CTYPE1", ctype, NULL, &status1);
+	if (!status1 && !strstr(ctype, "TAN"))
+		return false;
+	fits_read_key(fileptr_, TDOUBLE, "CRVAL1", &crval1, NULL, &status);
+	fits_read_key(fileptr_, TDOUBLE, "CRVAL2", &crval2, NULL, &status);
+	fits_read_key(fileptr_, TDOUBLE, "CRPIX1", &crpix1, NULL, &status);
+	fits_read_key(fileptr_, TDOUBLE, "CRPIX2", &crpix2, NULL, &status);
+	fits_read_key(fileptr_, TDOUBLE, "CD1_1", &cd11, NULL, &status1);
+	if (!status1) {
+		fits_read_key(fileptr_, TDOUBLE, "CD1_2", &cd12, NULL, &status);
+		fits_read_key(fileptr_, TDOUBLE, "CD2_1", &cd21, NULL, &status);
+		fits_read_key(fileptr_, TDOUBLE, "CD2_2", &cd22, NULL, &status);
+	} else {// CDELT + CROTA2
+		status1 = 0;
+		fits_read_key(fileptr_, TDOUBLE, "CDELT1", &cdelt1, NULL, &status);
+		fits_read_key(fileptr_, TDOUBLE, "CDELT2", &cdelt2, NULL, &status);
+		fits_read_key(fileptr_, TDOUBLE, "CROTA2", &crota, NULL, &status1);
+		crota *= D2R;
+		cd11 = cdelt1 * cos(crota);
+		cd12 = -cdelt2 * sin(crota);
+		cd21 = cdelt1 * sin(crota);
+		cd22 = cdelt2 * cos(crota);
+	}
+	if (status) {
+		fill_errmsg(status);
+		return false;
+	}
+
+	// 天球坐标 -> 标准坐标
+	double dra = (ra - crval1) * D2R, dec0 = crval2 * D2R;
+	double cosc, xi, eta, det;
+	dec *= D2R;
+	cosc = sin(dec0) * sin(dec) + cos(dec0) * cos(dec) * cos(dra);
+	if (cosc <= 0.0 || (det = cd11 * cd22 - cd12 * cd21) == 0.0)
+		return false;
+	xi  = cos(dec) * sin(dra) / cosc / D2R;
+	eta = (cos(dec0) * sin(dec) - sin(dec0) * cos(dec) * cos(dra)) / cosc / D2R;
+	// 标准坐标 -> 像素位置
+	x = crpix1 - 1.0 + (cd22 * xi - cd12 * eta) / det - x0_;
+	y = crpix2 - 1.0 + (cd11 * eta - cd21 * xi) / det - y0_;
+	return true;
+}
+
 void FitsHandler::GetDimension(int &cols, int &rows) {
 	cols = cols_;
 	rows = rows_;
 }
 
+int FitsHandler::GetBitpix() {
+	FitsLock lck;
+	if (!fileptr_)
+		return 0;
+	int status(0);
+	int bitpix(0);
+	fits_read_key(fileptr_, TINT, "BITPIX", &bitpix, NULL, &status);
+	fill_errmsg(status);
+	return status ? 0 : bitpix;
+}
+
 float FitsHandler::GetExptime() {
+	FitsLock lck;
 	if (!fileptr_)
 		return -1.0;
 	int status(0);
@@ -91,10 +294,11 @@ float FitsHandler::GetExptime() {
  * 查询结果
  */
 bool FitsHandler::GetDateobs(string &dateobs) {
+	FitsLock lck;
 	if (!fileptr_)
 		return false;
 	int status(0);
-	char str[40];
+	char str[FLEN_VALUE];
 	fits_read_key(fileptr_, TSTRING, "DATE-OBS", str, NULL, &status);
 	fill_errmsg(status);
 	if (!status)
@@ -109,10 +313,11 @@ bool FitsHandler::GetDateobs(string &dateobs) {
  * 查询结果
  */
 bool FitsHandler::GetTimeobs(string &timeobs) {
+	FitsLock lck;
 	if (!fileptr_)
 		return false;
 	int status(0);
-	char str[40];
+	char str[FLEN_VALUE];
 	fits_read_key(fileptr_, TSTRING, "TIME-OBS", str, NULL, &status);
 	fill_errmsg(status);
 	if (!status)
@@ -121,31 +326,200 @@ bool FitsHandler::GetTimeobs(string &timeobs) {
 	return status == 0;
 }
 
+bool FitsHandler::GetImagetyp(string &imgtyp) {
+	FitsLock lck;
+	if (!fileptr_)
+		return false;
+	int status(0);
+	char str[FLEN_VALUE];
+	fits_read_key(fileptr_, TSTRING, "IMAGETYP", str, NULL, &status);
+	fill_errmsg(status);
+	if (!status)
+		imgtyp = str;
+
+	return status == 0;
+}
+
+bool FitsHandler::GetHeader(std::vector<string> &cards) {
+	FitsLock lck;
+	if (!fileptr_)
+		return false;
+	int status(0), nkeys, i, len, cls;
+	char card[FLEN_CARD], name[FLEN_KEYWORD];
+	double crpix;
+
+	fits_get_hdrspace(fileptr_, &nkeys, NULL, &status);
+	for (i = 1; i <= nkeys && !status; ++i) {
+		fits_read_record(fileptr_, i, card, &status);
+		cls = fits_get_keyclass(card);
+		if (status || cls <= TYP_NULL_KEY || cls == TYP_CKSUM_KEY)
+			continue;
+		if (trim_) {// 有效区坐标
+			fits_get_keyname(card, name, &len, &status);
+			if (!strcmp(name, "TRIMSEC") || !strcmp(name, "BIASSEC"))
+				continue;
+			if (!strcmp(name, "CRPIX1") || !strcmp(name, "CRPIX2")) {
+				fits_read_key(fileptr_, TDOUBLE, name, &crpix, NULL, &status);
+				crpix -= name[5] == '1' ? x0_ : y0_;
+				snprintf(card, FLEN_CARD, "%-8.8s= %20.12G", name, crpix);
+			}
+		}
+		cards.push_back(card);
+	}
+	fill_errmsg(status);
+
+	return status == 0;
+}
+
 bool FitsHandler::LoadPixels(float *data, int pixels, int row, int col) {
+	FitsLock lck;
 	if (!fileptr_)
 		return false;
 	int status(0);
 	if (pixels <= 0)
 		pixels = cols_;
-	fits_read_img(fileptr_, TFLOAT, row * cols_ + col + 1, pixels, NULL, data,
-			NULL, &status);
+	if (trim_)
+		return load_trimmed(data, long(row) * cols_ + col, pixels);
+	fits_read_img(fileptr_, TFLOAT, row * cols_ + col + 1, pixels,
+			(void*) &NULL_PIXEL, data, NULL, &status);
 	fill_errmsg(status);
 
 	return status == 0;
 }
 
 bool FitsHandler::LoadImage(float *data) {
+	FitsLock lck;
 	if (!fileptr_)
 		return false;
 	int status(0);
-	fits_read_img(fileptr_, TFLOAT, 1, rows_ * cols_, NULL, data, NULL,
+	if (trim_)
+		return load_trimmed(data, 0, rows_ * cols_);
+	fits_read_img(fileptr_, TFLOAT, 1, rows_ * cols_, (void*) &NULL_PIXEL, data,
+			NULL, &status);
+	fill_errmsg(status);
+
+	return status == 0;
+}
+
+bool FitsHandler::LoadExtension(const char *extname, float *data) {
+	FitsLock lck;
+	if (!fileptr_)
+		return false;
+	int status(0), bitpix, naxis;
+	long naxes[2] = { 0, 0 };
+
+	fits_movnam_hdu(fileptr_, IMAGE_HDU, (char*) extname, 0, &status);
+	fits_get_img_param(fileptr_, 2, &bitpix, &naxis, naxes, &status);
+	if (!status && (naxes[0] != cols_ || naxes[1] != rows_))
+		status = BAD_DIMEN;
+	if (!status)
+		fits_read_img(fileptr_, TFLOAT, 1, long(rows_) * cols_,
+				(void*) &NULL_PIXEL, data, NULL, &status);
+	fill_errmsg(status);
+	int status1(0);
+	fits_movabs_hdu(fileptr_, 1, NULL, &status1);
+	return status == 0;
+}
+
+bool FitsHandler::parse_section(const string &sec, int &x0, int &x1, int &y0,
+		int &y1) {
+	int xa, xb, ya, yb;
+	if (sscanf(sec.c_str(), " [%d:%d,%d:%d]", &xa, &xb, &ya, &yb) != 4)
+		return false;
+	x0 = min(xa, xb) - 1;
+	x1 = max(xa, xb);
+	y0 = min(ya, yb) - 1;
+	y1 = max(ya, yb);
+	return x0 >= 0 && y0 >= 0 && x1 <= fcols_ && y1 <= frows_;
+}
+
+int FitsHandler::read_medians(int row0, int row1) {
+	if (row0 >= row1)
+		return 0;
+	long fpixel[] = { bx0_ + 1, y0_ + row0 + 1 };
+	long lpixel[] = { bx0_ + bcols_, y0_ + row1 };
+	long inc[] = { 1, 1 };
+	fltarr buff = alloc(size_t(bcols_) * (row1 - row0));
+	float *x = buff.get(), *m = median_.get();
+	int status(0), n(bcols_);
+
+	fits_read_subset(fileptr_, TFLOAT, fpixel, lpixel, inc, NULL, x, NULL,
 			&status);
+	for (int i = row0; !status && i < row1; ++i, x += n) {
+		nth_element(x, x + n / 2, x + n);
+		m[i] = x[n / 2];
+	}
+	return status;
+}
+
+int FitsHandler::load_medians(int row0, int row1) {
+	int a(max(row0 - half_, 0)), b(min(row1 + half_, rows_)), status;
+
+	if (mrow0_ >= mrow1_) {
+		if (!(status = read_medians(a, b))) {
+			mrow0_ = a;
+			mrow1_ = b;
+		}
+		return status;
+	}
+	// 向两侧扩展已计算区间, 不相连时一并读取间隔行
+	if (a < mrow0_) {
+		if ((status = read_medians(a, mrow0_)))
+			return status;
+		mrow0_ = a;
+	}
+	if (b > mrow1_) {
+		if ((status = read_medians(mrow1_, b)))
+			return status;
+		mrow1_ = b;
+	}
+	return 0;
+}
+
+bool FitsHandler::load_trimmed(float *data, long first, long pixels) {
+	int status(0);
+	long row, col, nrow, ncol, n, i, j, k0, k1;
+	long fpixel[2], lpixel[2], inc[] = { 1, 1 };
+	float level, *x;
+	double sum;
+
+	for (; pixels > 0 && !status; first += n, pixels -= n, data += n) {
+		row = first / cols_;
+		col = first % cols_;
+		if (!col && pixels >= cols_) {// 整行
+			nrow = pixels / cols_;
+			ncol = cols_;
+		} else {
+			nrow = 1;
+			ncol = min(pixels, cols_ - col);
+		}
+		n = nrow * ncol;
+		fpixel[0] = x0_ + col + 1;
+		fpixel[1] = y0_ + row + 1;
+		lpixel[0] = fpixel[0] + ncol - 1;
+		lpixel[1] = fpixel[1] + nrow - 1;
+		fits_read_subset(fileptr_, TFLOAT, fpixel, lpixel, inc,
+				(void*) &NULL_PIXEL, data, NULL, &status);
+		if (status || !median_ || (status = load_medians(row, row + nrow)))
+			continue;
+		for (i = 0, x = data; i < nrow; ++i, x += ncol) {
+			// 逐行中值滑动平均
+			k0 = max(row + i - half_, 0L);
+			k1 = min(row + i + half_ + 1, long(rows_));
+			for (j = k0, sum = 0.0; j < k1; ++j)
+				sum += median_[j];
+			level = float(sum / (k1 - k0));
+			for (j = 0; j < ncol; ++j)
+				x[j] -= level;
+		}
+	}
 	fill_errmsg(status);
 
 	return status == 0;
 }
 
 bool FitsHandler::WriteImage(float *data, int datatype) {
+	FitsLock lck;
 	if (!fileptr_)
 		return false;
 	int status(0);
@@ -4,6 +4,10 @@
  * @author Xiaomeng Lu
  * @note
  * - 以读模式打开文件
+ * - 读取时空值(BLANK等)转换为NaN
+ * - 启用过扫区改正后, 读取时逐行扣除过扫区电平并裁剪至有效区. 行列数和读取位置
+ *   均相对有效区
+ * - 逐行过扫区中值在首次读取对应行时计算, 仅读取所需行及平滑窗口范围内的过扫区
  */
 
 #ifndef FITSHANDLER_H_
@@ -12,11 +16,35 @@
 #include <longnam.h>
 #include <fitsio.h>
 #include <string>
+#include <vector>
+#include "BufferPool.h"
 
 using std::string;
 
 namespace AstroUtil {
 //////////////////////////////////////////////////////////////////////////////
+/*!
+ * @brief 作用域内串行访问cfitsio
+ * @note
+ * - cfitsio非可重入编译时, 各线程即使访问不同文件也共享内部缓冲区.
+ *   此时构造时加进程内全局锁, 析构时释放; 可重入编译时不加锁
+ * - FitsHandler各接口已加锁. 直接调用cfitsio函数时须在作用域内构造
+ */
+class FitsLock {
+public:
+	FitsLock();
+	virtual ~FitsLock();
+
+protected:
+	bool locked_;	//< 已加锁
+
+public:
+	/*!
+	 * @brief 查询cfitsio是否为可重入编译
+	 */
+	static bool Reentrant();
+};
+
 class FitsHandler {
 public:
 	FitsHandler();
@@ -25,6 +53,14 @@ public:
 protected:
 	fitsfile *fileptr_;	//< 文件访问指针
 	int rows_, cols_;	//< 行列数
+	bool trim_;			//< 启用过扫区改正和裁剪
+	int fcols_, frows_;	//< 原始图像行列数
+	int x0_, y0_;		//< 有效区起始位置
+	BufferPool *pool_;	//< 缓存区池. 为NULL时由堆分配
+	fltarr median_;		//< 有效区各行的过扫区中值. 为空时不改正
+	int mrow0_, mrow1_;	//< median_中已计算的行区间[mrow0_, mrow1_)
+	int bx0_, bcols_;	//< 逐行统计的过扫区起始列及列数
+	int half_;			//< 逐行中值滑动平均的半窗口行数
 	char errmsg[100];	//< 错误提示
 
 protected:
@@ -37,6 +73,51 @@ protected:
 	 * @param code cfitsio错误代码
 	 */
 	void fill_errmsg(int code);
+	/*!
+	 * @brief 申请缓存区. 设置缓存区池时由池分配
+	 * @param n 数据长度
+	 */
+	fltarr alloc(size_t n);
+	/*!
+	 * @brief 解析区域描述
+	 * @param sec 区域描述, 格式: [x1:x2,y1:y2], 从1开始且包含端点
+	 * @param x0  起始列, 从0开始
+	 * @param x1  结束列, 不含
+	 * @param y0  起始行, 从0开始
+	 * @param y1  结束行, 不含
+	 * @return
+	 * 解析结果. 区域须位于原始图像内
+	 */
+	bool parse_section(const string &sec, int &x0, int &x1, int &y0, int &y1);
+	/*!
+	 * @brief 读取有效区行区间[row0, row1)对应的过扫区, 计算逐行中值
+	 * @param row0 起始行
+	 * @param row1 结束行, 不含
+	 * @return
+	 * cfitsio错误代码
+	 */
+	int read_medians(int row0, int row1);
+	/*!
+	 * @brief 计算有效区行区间[row0, row1)及平滑窗口所需的过扫区逐行中值
+	 * @param row0 起始行
+	 * @param row1 结束行, 不含
+	 * @return
+	 * cfitsio错误代码
+	 * @note
+	 * 与已计算区间合并为连续区间, 仅读取新增行
+	 */
+	int load_medians(int row0, int row1);
+	/*!
+	 * @brief 加载有效区数据并扣除过扫区电平
+	 * @param data   数据缓存区
+	 * @param first  有效区内首个像素序号. 从0开始
+	 * @param pixels 像素数
+	 * @return
+	 * 数据加载结果
+	 * @note
+	 * 整行部分以矩形区域一次读取
+	 */
+	bool load_trimmed(float *data, long first, long pixels);
 
 public:
 	/*!
@@ -52,6 +133,12 @@ public:
 	 * 文件打开结果
 	 */
 	bool Open(const char *filepath);
+	/*!
+	 * @brief 关闭文件
+	 * @return
+	 * 关闭结果. 新建文件关闭时写入缓存数据, 失败时返回false
+	 */
+	bool Close();
 	/*!
 	 * @brief 创建图像类型FITS文件
 	 * @param filepath 文件路径
@@ -61,12 +148,60 @@ public:
 	 * @return
 	 */
 	bool CreateImage(const char *filepath, int bitpix, int width, int height);
+	/*!
+	 * @brief 在已创建文件末尾添加图像扩展
+	 * @param extname 扩展名, 写入关键字EXTNAME
+	 * @param bitpix  像素数据位数
+	 * @return
+	 * 添加结果. 扩展尺寸与主图像相同, 后续WriteImage写入该扩展
+	 */
+	bool AppendImage(const char *extname, int bitpix);
+	/*!
+	 * @brief 设置缓存区池
+	 * @param pool 缓存区池. 过扫区数据和逐行电平由池分配, 计入池内存上限
+	 * @note
+	 * 调用SetOverscan()前设置. 池须在本对象之前构造
+	 */
+	void SetPool(BufferPool *pool);
+	/*!
+	 * @brief 启用过扫区改正和裁剪
+	 * @param trimsec 有效区, 格式: [x1:x2,y1:y2]. 为空时使用关键字TRIMSEC
+	 * @param biassec 过扫区, 格式同上. 为空时使用关键字BIASSEC
+	 * @param smooth  过扫区逐行电平的平滑窗口行数. <= 1时不平滑
+	 * @return
+	 * 启用结果. 有效区和过扫区均未定义或无效时返回false, 读取方式不变
+	 * @note
+	 * - 过扫区覆盖有效区各行时, 逐行取中值并滑动平均; 否则取过扫区整体中值
+	 * - 逐行中值在读取数据时按需计算, 仅读取区域时不读取其它行的过扫区
+	 * - 未定义有效区时不裁剪; 未定义过扫区时仅裁剪
+	 * - 打开文件后调用一次
+	 */
+	bool SetOverscan(const string &trimsec = "", const string &biassec = "",
+			int smooth = 0);
+	/*!
+	 * @brief 依据TAN投影WCS关键字, 由天球坐标计算像素位置
+	 * @param ra  赤经, 量纲: 角度
+	 * @param dec 赤纬, 量纲: 角度
+	 * @param x   列位置, 从0开始
+	 * @param y   行位置, 从0开始
+	 * @return
+	 * 计算结果. 缺少CRVAL/CRPIX/CD(或CDELT)关键字, 或非TAN投影时返回false
+	 * @note
+	 * 启用过扫区改正后, 位置相对有效区
+	 */
+	bool SkyToPixel(double ra, double dec, double &x, double &y);
 	/*!
 	 * @brief 数据纬度
 	 * @param cols 列数
 	 * @param rows 行数
 	 */
 	void GetDimension(int &cols, int &rows);
+	/*!
+	 * @brief 查询像素数据位数
+	 * @return
+	 * 关键字BITPIX的值. 当查询失败时, 返回0
+	 */
+	int GetBitpix();
 	/*!
 	 * @brief 查询曝光时间
 	 * @return
@@ -86,6 +221,23 @@ public:
 	 * 查询结果
 	 */
 	bool GetTimeobs(string &timeobs);
+	/*!
+	 * @brief 查询图像类型
+	 * @param imgtyp 关键字IMAGETYP的值
+	 * @return
+	 * 查询结果
+	 */
+	bool GetImagetyp(string &imgtyp);
+	/*!
+	 * @brief 读取可复制到结果文件的头记录
+	 * @param cards 头记录, 追加至末尾
+	 * @return
+	 * 读取结果
+	 * @note
+	 * - 不含结构、比例、空值和校验关键字, 由结果文件重新生成
+	 * - 启用过扫区改正后, CRPIX1/CRPIX2相对有效区, 并剔除TRIMSEC/BIASSEC
+	 */
+	bool GetHeader(std::vector<string> &cards);
 	/*!
 	 * @brief 从图像型FITS中加载一行数据
 	 * @param data    数据缓存区
@@ -103,6 +255,17 @@ public:
 	 * 数据加载结果
 	 */
 	bool LoadImage(float *data);
+	/*!
+	 * @brief 从图像扩展中加载数据
+	 * @param extname 扩展名
+	 * @param data    数据缓存区
+	 * @return
+	 * 加载结果. 扩展不存在或尺寸与主图像不同时返回false
+	 * @note
+	 * - 不执行过扫区改正
+	 * - 加载后返回主图像
+	 */
+	bool LoadExtension(const char *extname, float *data);
 	/*!
 	 * @brief 将图像数据写入FITS文件
 	 * @param data     数据缓存区
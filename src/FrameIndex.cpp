@@ -0,0 +1,220 @@
+/*
+ * @file FrameIndex.cpp FITS文件头索引
+ */
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/bind/bind.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fstream>
+#include <map>
+#include "FrameIndex.h"
+#include "FitsHandler.h"
+#include "TaskGraph.h"
+
+using namespace std;
+using namespace boost::filesystem;
+using namespace boost::placeholders;
+
+namespace AstroUtil {
+// 索引文件名及格式标识
+const char *INDEX_FILENAME = ".fitspre.idx";
+const char *INDEX_MAGIC = "# fitspre frame index v1";
+
+/*
+ * 替换字符串中的分隔符, 保证索引记录单行存储
+ */
+static string sanitize(const string &str) {
+	string text(str);
+	for (string::iterator it = text.begin(); it != text.end(); ++it) {
+		if (*it == '\t' || *it == '\n' || *it == '\r')
+			*it = ' ';
+	}
+	return text;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+FrameIndex::FrameIndex() {
+	seed_ = unsigned(time(NULL)) ^ (unsigned(getpid()) << 16)
+			^ unsigned((size_t) this);
+}
+
+FrameIndex::~FrameIndex() {
+}
+
+bool FrameIndex::Load(const string &pathname, int nthread) {
+	boost::system::error_code ec;
+	if (!is_directory(pathname, ec))
+		return false;
+
+	vector<frame_info> cache;
+	map<string, int> cached;
+	vector<int> stale;
+	directory_iterator itend = directory_iterator();
+	frame_info info;
+	int i, n;
+
+	pathname_ = pathname;
+	frames_.clear();
+	if (load_cache(cache)) {
+		for (i = 0, n = cache.size(); i < n; ++i)
+			cached[cache[i].filename] = i;
+	}
+	// 遍历目录. 文件大小和修改时间未变时沿用索引记录
+	for (directory_iterator x = directory_iterator(pathname, ec);
+			!ec && x != itend; x.increment(ec)) {
+		if (!is_regular_file(x->status()))
+			continue;
+		info.filename = x->path().filename().string();
+		if (!info.filename.find(INDEX_FILENAME)) // 索引文件及其临时文件
+			continue;
+		info.size = file_size(x->path(), ec);
+		info.mtime = last_write_time(x->path(), ec);
+		if (ec)
+			continue;
+
+		map<string, int>::iterator it = cached.find(info.filename);
+		if (it != cached.end() && cache[it->second].size == info.size
+				&& cache[it->second].mtime == info.mtime) {
+			frames_.push_back(cache[it->second]);
+		} else {
+			info.valid = false;
+			stale.push_back(frames_.size());
+			frames_.push_back(info);
+		}
+	}
+	// 并行读取变化文件的头信息
+	if (stale.size()) {
+		parallel_for(stale.size(), nthread,
+				boost::bind(&FrameIndex::read_header, this, &stale, _1));
+		save_cache();
+	} else if (cache.size() != frames_.size()) {// 有文件被删除
+		save_cache();
+	}
+	return true;
+}
+
+int FrameIndex::Count() {
+	return frames_.size();
+}
+
+const frame_info &FrameIndex::operator[](int i) {
+	return frames_[i];
+}
+
+string FrameIndex::FilePath(int i) {
+	path filepath = pathname_;
+	filepath /= path(frames_[i].filename);
+	return filepath.string();
+}
+
+bool FrameIndex::Match(const frame_filter &filter, int i) {
+	frame_info &info = frames_[i];
+	return info.valid
+			&& !(filter.prefix.size() && info.filename.find(filter.prefix))
+			&& !(filter.imgtyp.size()
+					&& boost::to_upper_copy(info.imgtyp).find(
+							boost::to_upper_copy(filter.imgtyp)) == string::npos)
+			&& !(filter.expmax >= filter.expmin
+					&& (info.exptime < filter.expmin
+							|| info.exptime > filter.expmax))
+			&& !(filter.cols > 0 && info.cols != filter.cols)
+			&& !(filter.rows > 0 && info.rows != filter.rows);
+}
+
+int FrameIndex::Select(const frame_filter &filter, vector<string> &filepaths) {
+	int n(0);
+
+	for (int i = 0; i < int(frames_.size()); ++i) {
+		if (!Match(filter, i))
+			continue;
+		filepaths.push_back(FilePath(i));
+		++n;
+	}
+	return n;
+}
+
+bool FrameIndex::read_header(const vector<int> *index, int i) {
+	frame_info &info = frames_[(*index)[i]];
+	FitsHandler fh;
+
+	info.bitpix = info.cols = info.rows = 0;
+	info.exptime = -1.0;
+	info.dateobs.clear();
+	info.imgtyp.clear();
+	if ((info.valid = fh.Open(FilePath((*index)[i]).c_str()))) {
+		fh.GetDimension(info.cols, info.rows);
+		info.bitpix = fh.GetBitpix();
+		info.exptime = fh.GetExptime();
+		fh.GetDateobs(info.dateobs);
+		fh.GetImagetyp(info.imgtyp);
+	}
+	return true;
+}
+
+bool FrameIndex::load_cache(vector<frame_info> &frames) {
+	path filepath = pathname_;
+	filepath /= path(INDEX_FILENAME);
+	std::ifstream in(filepath.c_str());
+	string line;
+	vector<string> tokens;
+	frame_info info;
+
+	if (!in.good() || !getline(in, line) || line != INDEX_MAGIC)
+		return false;
+	while (getline(in, line)) {
+		boost::split(tokens, line, boost::is_any_of("\t"));
+		if (tokens.size() != 10)
+			continue;
+		info.filename = tokens[0];
+		info.size     = strtoull(tokens[1].c_str(), NULL, 10);
+		info.mtime    = time_t(strtoll(tokens[2].c_str(), NULL, 10));
+		info.valid    = tokens[3] == "1";
+		info.bitpix   = atoi(tokens[4].c_str());
+		info.cols     = atoi(tokens[5].c_str());
+		info.rows     = atoi(tokens[6].c_str());
+		info.exptime  = float(atof(tokens[7].c_str()));
+		info.dateobs  = tokens[8];
+		info.imgtyp   = tokens[9];
+		frames.push_back(info);
+	}
+	return true;
+}
+
+bool FrameIndex::save_cache() {
+	path filepath = pathname_;
+	filepath /= path(INDEX_FILENAME);
+	char suffix[40];
+	sprintf(suffix, ".%d.%08x.tmp", int(getpid()), unsigned(rand_r(&seed_)));
+	string tmppath = filepath.string() + suffix;
+	// 以独占方式创建, 避免与其它进程的临时文件冲突
+	int fd = open(tmppath.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+	FILE *fp = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!fp) {
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	fprintf(fp, "%s\n", INDEX_MAGIC);
+	for (vector<frame_info>::iterator it = frames_.begin(); it != frames_.end();
+			++it) {
+		fprintf(fp, "%s\t%llu\t%lld\t%d\t%d\t%d\t%d\t%g\t%s\t%s\n",
+				sanitize(it->filename).c_str(), it->size, (long long) it->mtime,
+				it->valid ? 1 : 0, it->bitpix, it->cols, it->rows, it->exptime,
+				sanitize(it->dateobs).c_str(), sanitize(it->imgtyp).c_str());
+	}
+	boost::system::error_code ec;
+	if (fclose(fp)) {
+		remove(tmppath, ec);
+		return false;
+	}
+	rename(tmppath, filepath, ec);
+	if (ec)
+		remove(tmppath, ec);
+	return !ec;
+}
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
@@ -0,0 +1,128 @@
+/*
+ * @file FrameIndex.h FITS文件头索引
+ * @version 0.1
+ * @author Xiaomeng Lu
+ * @note
+ * - 并行读取目录下各文件的头信息: NAXIS*, BITPIX, EXPTIME, DATE-OBS, IMAGETYP
+ * - 索引存储在目录下的.fitspre.idx文件中, 以文件名+大小+修改时间为键值.
+ *   再次扫描时仅重新读取变化的文件
+ * - 非FITS文件同样记录在索引中, 避免重复尝试打开
+ */
+
+#ifndef FRAMEINDEX_H_
+#define FRAMEINDEX_H_
+
+#include <time.h>
+#include <string>
+#include <vector>
+
+using std::string;
+
+namespace AstroUtil {
+//////////////////////////////////////////////////////////////////////////////
+struct frame_info {	//< 文件头信息
+	string filename;	//< 文件名
+	unsigned long long size;	//< 文件大小, 量纲: 字节
+	time_t mtime;		//< 文件修改时间
+	bool valid;			//< FITS文件有效标志
+	int bitpix;			//< 像素数据位数
+	int cols, rows;		//< 图像尺寸
+	float exptime;		//< 曝光时间. 无该关键字时小于0
+	string dateobs;		//< 曝光起始时间
+	string imgtyp;		//< 图像类型
+};
+
+struct frame_filter {	//< 文件筛选条件
+	string prefix;		//< 文件名前缀. 为空时不限制
+	string imgtyp;		//< 图像类型, 不区分大小写的子串. 为空时不限制
+	float expmin, expmax;	//< 曝光时间范围. expmax < expmin时不限制
+	int cols, rows;		//< 图像尺寸. <= 0时不限制
+
+public:
+	frame_filter() {
+		expmin = 0.0;
+		expmax = -1.0;
+		cols = rows = 0;
+	}
+};
+
+class FrameIndex {
+public:
+	FrameIndex();
+	virtual ~FrameIndex();
+
+protected:
+	string pathname_;	//< 目录名
+	std::vector<frame_info> frames_;	//< 文件头信息
+	unsigned seed_;		//< 临时文件名随机后缀种子
+
+protected:
+	/*!
+	 * @brief 加载索引文件
+	 * @param frames 索引记录
+	 * @return
+	 * 加载结果
+	 */
+	bool load_cache(std::vector<frame_info> &frames);
+	/*!
+	 * @brief 保存索引文件
+	 * @return
+	 * 保存结果
+	 * @note
+	 * - 先写入临时文件再更名. 目录不可写时不影响扫描结果
+	 * - 临时文件名含进程号和随机后缀, 多个进程同时扫描同一目录时互不覆盖
+	 */
+	bool save_cache();
+	/*!
+	 * @brief 线程函数: 读取一个文件的头信息
+	 * @param index 需更新的文件序号
+	 * @param i     index中的序号
+	 * @return
+	 * 总是返回true
+	 */
+	bool read_header(const std::vector<int> *index, int i);
+
+public:
+	/*!
+	 * @brief 扫描目录, 建立文件头索引
+	 * @param pathname 目录名
+	 * @param nthread  读取文件头的线程数. <= 0时使用处理器核数
+	 * @return
+	 * 扫描结果
+	 */
+	bool Load(const string &pathname, int nthread = 0);
+	/*!
+	 * @brief 查询文件数量
+	 */
+	int Count();
+	/*!
+	 * @brief 查询文件头信息
+	 * @param i 文件序号
+	 */
+	const frame_info &operator[](int i);
+	/*!
+	 * @brief 生成文件路径
+	 * @param i 文件序号
+	 */
+	string FilePath(int i);
+	/*!
+	 * @brief 检查文件是否符合筛选条件
+	 * @param filter 筛选条件
+	 * @param i      文件序号
+	 * @return
+	 * 有效FITS文件且符合全部条件时返回true
+	 */
+	bool Match(const frame_filter &filter, int i);
+	/*!
+	 * @brief 按文件头信息筛选文件
+	 * @param filter    筛选条件
+	 * @param filepaths 符合条件的文件路径
+	 * @return
+	 * 符合条件的文件数量
+	 */
+	int Select(const frame_filter &filter, std::vector<string> &filepaths);
+};
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
+
+#endif /* FRAMEINDEX_H_ */
@@ -0,0 +1,173 @@
+/*
+ * @file TaskGraph.cpp 带依赖关系的任务调度接口
+ */
+#include <boost/thread/thread.hpp>
+#include <boost/bind/bind.hpp>
+#include <new>
+#include "TaskGraph.h"
+
+namespace AstroUtil {
+//////////////////////////////////////////////////////////////////////////////
+TaskGraph::TaskGraph() {
+	finished_ = 0;
+}
+
+TaskGraph::~TaskGraph() {
+}
+
+int TaskGraph::AddTask(const TaskFunc &func, int dep1, int dep2, int dep3) {
+	int id = int(nodes_.size());
+	int deps[] = { dep1, dep2, dep3 };
+	task_node node;
+
+	node.func = func;
+	node.state = TASK_WAIT;
+	node.remain = 0;
+	node.dep_failed = false;
+	nodes_.push_back(node);
+	for (int i = 0; i < 3; ++i) {
+		if (deps[i] >= 0 && deps[i] < id) {
+			nodes_[deps[i]].next.push_back(id);
+			++nodes_[id].remain;
+		}
+	}
+	return id;
+}
+
+bool TaskGraph::Run(int nthread) {
+	int n(nodes_.size()), i;
+	bool ok(true);
+
+	finished_ = 0;
+	ready_.clear();
+	for (i = 0; i < n; ++i) {
+		if (!nodes_[i].remain)
+			ready_.push_back(i);
+	}
+	if (nthread <= 0)
+		nthread = boost::thread::hardware_concurrency();
+	if (nthread > n)
+		nthread = n;
+	if (nthread > 1) {
+		boost::thread_group threads;
+		for (i = 0; i < nthread; ++i)
+			threads.create_thread(boost::bind(&TaskGraph::thread_run, this));
+		threads.join_all();
+	} else if (n) {
+		thread_run();
+	}
+
+	for (i = 0; i < n && ok; ++i)
+		ok = nodes_[i].state == TASK_DONE;
+	return ok;
+}
+
+int TaskGraph::State(int id) {
+	if (id < 0 || id >= int(nodes_.size()))
+		return TASK_SKIP;
+	boost::mutex::scoped_lock lck(mtx_);
+	return nodes_[id].state;
+}
+
+void TaskGraph::thread_run() {
+	int n(nodes_.size()), id;
+	bool ok;
+	boost::mutex::scoped_lock lck(mtx_);
+
+	while (finished_ < n) {
+		if (ready_.empty()) {
+			cv_.wait(lck);
+			continue;
+		}
+		id = ready_.front();
+		ready_.pop_front();
+		nodes_[id].state = TASK_RUN;
+
+		lck.unlock();
+		try {
+			ok = nodes_[id].func();
+		}
+		catch(std::bad_alloc &) {// 超出内存预算, 视为任务失败
+			ok = false;
+		}
+		lck.lock();
+
+		finish_task(id, ok);
+		cv_.notify_all();
+	}
+}
+
+void TaskGraph::finish_task(int id, bool ok) {
+	task_node &node = nodes_[id];
+	if (node.state != TASK_SKIP)
+		node.state = ok ? TASK_DONE : TASK_FAIL;
+	++finished_;
+
+	for (std::vector<int>::iterator it = node.next.begin();
+			it != node.next.end(); ++it) {
+		task_node &next = nodes_[*it];
+		if (!ok)
+			next.dep_failed = true;
+		if (--next.remain == 0) {
+			if (next.dep_failed) {// 依赖任务失败, 跳过该任务及其后续任务
+				next.state = TASK_SKIP;
+				finish_task(*it, false);
+			} else {
+				ready_.push_back(*it);
+			}
+		}
+	}
+}
+//////////////////////////////////////////////////////////////////////////////
+struct loop_ctx {	//< 并行循环上下文
+	int n;			//< 循环次数
+	int next;		//< 下一待领取序号
+	bool ok;		//< 执行结果
+	boost::mutex mtx;
+};
+
+static void loop_run(loop_ctx *ctx, const LoopFunc *func, int ithread) {
+	int i;
+	bool ok;
+	while (true) {
+		{
+			boost::mutex::scoped_lock lck(ctx->mtx);
+			if (!ctx->ok || ctx->next >= ctx->n)
+				break;
+			i = ctx->next++;
+		}
+		try {
+			ok = (*func)(i, ithread);
+		}
+		catch(std::bad_alloc &) {// 超出内存预算, 终止循环
+			ok = false;
+		}
+		if (!ok) {
+			boost::mutex::scoped_lock lck(ctx->mtx);
+			ctx->ok = false;
+		}
+	}
+}
+
+bool parallel_for(int n, int nthread, const LoopFunc &func) {
+	loop_ctx ctx;
+
+	ctx.n = n;
+	ctx.next = 0;
+	ctx.ok = true;
+	if (nthread <= 0)
+		nthread = boost::thread::hardware_concurrency();
+	if (nthread > n)
+		nthread = n;
+	if (nthread > 1) {
+		boost::thread_group threads;
+		for (int i = 0; i < nthread; ++i)
+			threads.create_thread(boost::bind(&loop_run, &ctx, &func, i));
+		threads.join_all();
+	} else {
+		loop_run(&ctx, &func, 0);
+	}
+	return ctx.ok;
+}
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
@@ -0,0 +1,110 @@
+/*
+ * @file TaskGraph.h 带依赖关系的任务调度接口
+ * @version 0.1
+ * @author Xiaomeng Lu
+ * @note
+ * - 任务以有向无环图组织, 无依赖或依赖已完成的任务并行执行
+ * - 任务返回false时, 其后续依赖任务不再执行
+ */
+
+#ifndef TASKGRAPH_H_
+#define TASKGRAPH_H_
+
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <deque>
+#include <vector>
+
+namespace AstroUtil {
+//////////////////////////////////////////////////////////////////////////////
+class TaskGraph {
+public:
+	TaskGraph();
+	virtual ~TaskGraph();
+
+public:
+	typedef boost::function<bool ()> TaskFunc;	//< 任务函数
+
+	enum {	//< 任务状态
+		TASK_WAIT,	//< 等待执行
+		TASK_RUN,	//< 执行中
+		TASK_DONE,	//< 执行成功
+		TASK_FAIL,	//< 执行失败
+		TASK_SKIP	//< 因依赖任务失败而跳过
+	};
+
+protected:
+	struct task_node {
+		TaskFunc func;			//< 任务函数
+		int state;				//< 任务状态
+		int remain;				//< 未完成的依赖任务数
+		bool dep_failed;		//< 依赖任务失败标志
+		std::vector<int> next;	//< 依赖本任务的后续任务
+	};
+
+	std::vector<task_node> nodes_;	//< 任务集合
+	std::deque<int> ready_;			//< 可执行任务队列
+	int finished_;					//< 已结束任务数
+	boost::mutex mtx_;				//< 互斥锁
+	boost::condition_variable cv_;	//< 状态变更通知
+
+protected:
+	/*!
+	 * @brief 线程函数: 循环执行可执行任务
+	 */
+	void thread_run();
+	/*!
+	 * @brief 任务结束, 更新后续任务状态
+	 * @param id 任务编号
+	 * @param ok 任务执行结果
+	 * @note
+	 * 调用前已锁定mtx_
+	 */
+	void finish_task(int id, bool ok);
+
+public:
+	/*!
+	 * @brief 添加任务
+	 * @param func 任务函数
+	 * @param dep1 依赖任务编号. < 0时忽略
+	 * @param dep2 依赖任务编号. < 0时忽略
+	 * @param dep3 依赖任务编号. < 0时忽略
+	 * @return
+	 * 任务编号
+	 */
+	int AddTask(const TaskFunc &func, int dep1 = -1, int dep2 = -1,
+			int dep3 = -1);
+	/*!
+	 * @brief 执行全部任务
+	 * @param nthread 工作线程数. <= 0时使用处理器核数
+	 * @return
+	 * 全部任务执行成功时返回true
+	 */
+	bool Run(int nthread = 0);
+	/*!
+	 * @brief 查询任务状态
+	 * @param id 任务编号
+	 * @return
+	 * 任务状态. 编号无效时返回TASK_SKIP
+	 */
+	int State(int id);
+};
+//////////////////////////////////////////////////////////////////////////////
+typedef boost::function<bool (int, int)> LoopFunc;	//< 循环体: (序号, 线程序号)
+
+/*!
+ * @brief 多线程执行循环, 各线程动态领取序号
+ * @param n       循环次数
+ * @param nthread 线程数. <= 0时使用处理器核数
+ * @param func    循环体. 返回false时终止循环
+ * @return
+ * 全部循环体执行成功时返回true
+ * @note
+ * 线程序号范围为[0, nthread), 可用于索引线程私有缓存区
+ */
+bool parallel_for(int n, int nthread, const LoopFunc &func);
+//////////////////////////////////////////////////////////////////////////////
+} /* namespace AstroUtil */
+
+#endif /* TASKGRAPH_H_ */
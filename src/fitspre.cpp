@@ -10,10 +10,13 @@
  - 2: 合并暗场
  - 3: 合并平场
  - 4: 图像预处理: 减本底/减暗场/除平场
+ - 5: 平移叠加
  @note
  - 合并后本底存储为 : ZERO.fit
  - 合并后暗场存储为 : DARK.fit
  - 合并后平场存储为 : FLAT.fit
+ - 叠加结果存储为   : COADD.fit
+ - 合并后标定图像附带VARIANCE(均值方差)和NCOMB(参与合并帧数)扩展
  - 原始图像文件目录与处理结果存储路径必须不同, 处理后图像文件将以原名存至结果路径
  - 无本底不可合并平场
  @note
@@ -38,48 +41,513 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <float.h>
+#include <sys/wait.h>
+#include <vector>
+#include <new>
 #include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include "ADIProcess.h"
+#include "FrameIndex.h"
 
 using namespace std;
 using namespace boost::filesystem;
 using namespace AstroUtil;
 
 void print_help() {
+	printf("Usage: fitspre -m mode -i dir [-p prefix] [-o dir] [-z ZERO.fit]\n");
+	printf("  -m 处理模式. 0: 合并本底; 1: 合并暗场; 2: 合并平场; 3: 处理图像; 4: 合并全部标定图像; 5: 平移叠加\n");
+	printf("  -i 原文件目录\n");
+	printf("  -p 原文件名前缀\n");
+	printf("  -o 结果存储目录\n");
+	printf("  -z 合并后本底文件路径. 用于合并暗场和平场\n");
+	printf("  -n 分片合并的分片数. 未指定-k和-M时, 在本机启动n个进程并拼接\n");
+	printf("  -k 分片序号. 仅合并该分片\n");
+	printf("  -M 仅拼接分片合并结果\n");
+	printf("  -P 仅生成分片合并计划. 计划、局部文件和合并结果存储在-o目录, 缺省为原文件目录\n");
+	printf("  --mem 内存预算, 可使用后缀K/M/G, 例如: --mem 2G\n");
+	printf("  --imgtyp 仅使用关键字IMAGETYP包含该字符串的文件, 不区分大小写\n");
+	printf("  --exptime 仅使用曝光时间在该范围内的文件. 格式: 下限:上限, 量纲: 秒\n");
+	printf("  --size 仅使用该尺寸的文件. 格式: 列数x行数, 例如: --size 4096x4096\n");
+	printf("  --screen 合并前质量筛选. 格式: 类型:中值下限:中值上限:噪声上限:饱和阈值:饱和比例上限\n");
+	printf("           类型为zero/dark/flat, 例如: --screen flat:5000:40000:0:60000:0.001\n");
+	printf("           可省略后续各项. 中值上限省略或 <= 0时不限制上限\n");
+	printf("  --dark 合并后暗场文件路径. 用于快速查看\n");
+	printf("  --flat 合并后平场文件路径. 用于快速查看\n");
+	printf("  --roi 快速查看区域(模式3). 格式: 起始列:起始行:宽度:高度\n");
+	printf("  --roi-sky 快速查看区域(模式3). 格式: 赤经:赤纬:宽度:高度, 量纲: 角度\n");
+	printf("  --output 输出数据类型: float/int16. 缺省为float\n");
+	printf("  --overscan 依据关键字TRIMSEC/BIASSEC扣除过扫区电平并裁剪\n");
+	printf("  --trimsec 有效区, 格式: [x1:x2,y1:y2]. 同时启用过扫区改正\n");
+	printf("  --biassec 过扫区, 格式同上. 同时启用过扫区改正\n");
+	printf("  --binning 叠加(模式5)估计偏移时的降采样因子. 缺省自动选择\n");
+	printf("  --integer-shift 叠加时按整像素平移. 缺省双线性插值\n");
+	printf("  --minmax 叠加时采用min-max算法. 缺省av-sigclip\n");
+	printf("  --cosmic 处理图像和快速查看时识别并修复宇宙线\n");
+	printf("  --gain 增益, 量纲: e-/ADU. 用于宇宙线识别和权重图, 缺省为1\n");
+	printf("  --rdnoise 读出噪声, 量纲: e-. 用于宇宙线识别和权重图, 缺省为10\n");
+	printf("  --weight 处理图像时输出逆方差权重图, 存储为WEIGHT扩展\n");
+	printf("  --hugepage 数据缓存区使用大页内存\n");
+	printf("  --stats 输出数据缓存区池统计信息\n");
+}
+
+/*
+ * 解析合并前质量筛选参数
+ * - 未给出中值上限或上限 <= 0时, 不限制上限
+ * - 上限小于下限时视为错误
+ */
+bool parse_screen(const char *str, ADIProcess &adip) {
+	char type[10];
+	param_screen param;
+	int n = sscanf(str, "%9[^:]:%f:%f:%f:%f:%f", type, &param.median_min,
+			&param.median_max, &param.rms_max, &param.saturation,
+			&param.satfrac_max);
+
+	if (n < 2)
+		return false;
+	if (n == 2 || param.median_max <= 0.0)
+		param.median_max = FLT_MAX;
+	else if (param.median_max < param.median_min)
+		return false;
+	param.enable = true;
+	if (!strcasecmp(type, "zero"))
+		adip.SetScreen(IMGTYP_ZERO, param);
+	else if (!strcasecmp(type, "dark"))
+		adip.SetScreen(IMGTYP_DARK, param);
+	else if (!strcasecmp(type, "flat"))
+		adip.SetScreen(IMGTYP_FLAT, param);
+	else
+		return false;
+	return true;
+}
 
+/*
+ * 解析文件头筛选条件中的曝光时间范围或图像尺寸
+ */
+bool parse_filter(const char *str, int ch, frame_filter &filter) {
+	if (ch == 'L')
+		return sscanf(str, "%f:%f", &filter.expmin, &filter.expmax) == 2
+				&& filter.expmax >= filter.expmin;
+	return sscanf(str, "%dx%d", &filter.cols, &filter.rows) == 2
+			&& filter.cols > 0 && filter.rows > 0;
+}
+
+/*
+ * 解析内存预算. 支持后缀K/M/G
+ */
+size_t parse_memory(const char *str) {
+	char *end;
+	double size = strtod(str, &end);
+
+	if (*end == 'k' || *end == 'K')
+		size *= 1024.0;
+	else if (*end == 'm' || *end == 'M')
+		size *= 1024.0 * 1024.0;
+	else if (*end == 'g' || *end == 'G')
+		size *= 1024.0 * 1024.0 * 1024.0;
+	return size > 0.0 ? size_t(size) : 0;
+}
+
+/*
+ * 解析快速查看区域
+ */
+bool parse_roi(const char *str, bool sky, param_roi &roi) {
+	roi.sky = sky;
+	if (sky)
+		return sscanf(str, "%lf:%lf:%d:%d", &roi.ra, &roi.dec, &roi.width,
+				&roi.height) == 4 && roi.width > 0 && roi.height > 0;
+	return sscanf(str, "%d:%d:%d:%d", &roi.x0, &roi.y0, &roi.width,
+			&roi.height) == 4 && roi.width > 0 && roi.height > 0;
+}
+
+/*
+ * 快速查看: 处理文件或目录下各文件中的指定区域
+ */
+bool process_roi(ADIProcess &adip, const string &pathname,
+		const frame_filter &filter, const param_roi &roi) {
+	FrameIndex index;
+	vector<string> filepaths;
+	roi_result rslt;
+	bool ok(true);
+
+	if (boost::filesystem::is_regular_file(pathname))
+		filepaths.push_back(pathname);
+	else if (index.Load(pathname))
+		index.Select(filter, filepaths);
+	for (vector<string>::iterator it = filepaths.begin();
+			it != filepaths.end(); ++it) {
+		boost::posix_time::ptime t0 =
+				boost::posix_time::microsec_clock::universal_time();
+		if (!adip.ProcessROI(*it, roi, rslt)) {
+			printf("%s: failed\n", it->c_str());
+			ok = false;
+			continue;
+		}
+		double ms = (boost::posix_time::microsec_clock::universal_time() - t0)
+				.total_microseconds() * 1E-3;
+		printf("%s: [%d:%d,%d:%d] back %.2f rms %.2f, %d objects, %.2f ms\n",
+				it->c_str(), rslt.x0 + 1, rslt.x0 + rslt.width, rslt.y0 + 1,
+				rslt.y0 + rslt.height, rslt.back, rslt.rms,
+				int(rslt.objects.size()), ms);
+		for (ObjectVec::iterator obj = rslt.objects.begin();
+				obj != rslt.objects.end(); ++obj) {
+			printf("  %8.2f %8.2f %12.1f %10.1f %5d\n", obj->x + 1.0,
+					obj->y + 1.0, obj->flux, obj->peak, obj->area);
+		}
+	}
+	return ok && filepaths.size();
+}
+
+/*
+ * 处理文件或目录下各文件, 以原文件名存至结果目录
+ */
+bool process_image(ADIProcess &adip, const string &pathname,
+		const frame_filter &filter, const string &output) {
+	FrameIndex index;
+	vector<string> filepaths;
+	bool ok(true);
+
+	if (output.empty() || (is_directory(pathname)
+			&& equivalent(path(pathname), path(output))))
+		return false;
+	if (is_regular_file(pathname))
+		filepaths.push_back(pathname);
+	else if (index.Load(pathname))
+		index.Select(filter, filepaths);
+	for (vector<string>::iterator it = filepaths.begin();
+			it != filepaths.end(); ++it) {
+		path filepath = output;
+		filepath /= path(*it).filename();
+		boost::posix_time::ptime t0 =
+				boost::posix_time::microsec_clock::universal_time();
+		if (!adip.ProcessImage(*it, filepath.string())) {
+			printf("%s: failed\n", it->c_str());
+			ok = false;
+			continue;
+		}
+		double ms = (boost::posix_time::microsec_clock::universal_time() - t0)
+				.total_microseconds() * 1E-3;
+		printf("%s: %.2f ms\n", it->c_str(), ms);
+	}
+	return ok && filepaths.size();
+}
+
+/*
+ * 在本机以多进程执行分片合并, 并拼接结果
+ */
+bool combine_shard_local(ADIProcess &adip, int mode, const string &pathname,
+		const string &prefix, const string &output, size_t mem, int nshard) {
+	vector<pid_t> pids;
+	int ishard, status;
+	bool rslt(true);
+
+	// 筛选和平场归一化系数仅计算一次, 各分片读取计划文件
+	if (!adip.PrepareShard(mode, pathname, prefix, output))
+		return false;
+	for (ishard = 0; ishard < nshard; ++ishard) {
+		pid_t pid = fork();
+		if (pid == 0) {// 子进程继承已加载的本底和筛选参数, 各进程平分内存预算
+			adip.SetMemoryBudget(mem / nshard);
+			_exit(adip.CombineShard(mode, pathname, prefix, output, ishard,
+					nshard) ? 0 : 1);
+		} else if (pid < 0) {
+			rslt = false;
+			break;
+		}
+		pids.push_back(pid);
+	}
+	for (vector<pid_t>::iterator it = pids.begin(); it != pids.end(); ++it) {
+		if (waitpid(*it, &status, 0) < 0 || !WIFEXITED(status)
+				|| WEXITSTATUS(status))
+			rslt = false;
+	}
+	return rslt && adip.MergeShard(mode, output, nshard);
 }
 
 /*
  * 命令行参数:
- * -m 处理模式. 0: 合并本底; 1: 合并暗场; 2: 合并平场; 3: 处理图像/提取目标. 缺省值3
+ * -m 处理模式. 0: 合并本底; 1: 合并暗场; 2: 合并平场; 3: 处理图像/提取目标;
+ *    4: 合并全部标定图像; 5: 平移叠加. 缺省值3
  * -i 原文件目录
  * -p 原文件名前缀. 缺省时处理原文件目录下所有文件
  * -o 结果存储目录
+ * -z 合并后本底文件路径
+ * -n 分片合并的分片数
+ * -k 分片序号
+ * -M 仅拼接分片合并结果
+ * -P 仅生成分片合并计划
+ * --mem 内存预算. 依据预算规划合并线程数、分块行数和统计方式
+ * --imgtyp 文件头筛选: IMAGETYP包含的字符串
+ * --exptime 文件头筛选: 曝光时间范围
+ * --size 文件头筛选: 图像尺寸
+ * --screen 合并前质量筛选参数. 可多次使用, 分别设置本底/暗场/平场
+ * --dark 合并后暗场文件路径
+ * --flat 合并后平场文件路径
+ * --roi 快速查看区域. 模式3时仅读取并处理-i指定文件(或目录下各文件)中的该区域
+ * --roi-sky 以天球坐标指定快速查看区域中心. 需TAN投影WCS
+ * --output 输出数据类型. float: 32位浮点数; int16: 16位整数, 由BSCALE/BZERO换算,
+ *          空值写为BLANK. 量化误差超过噪声的1/4时改为32位输出
+ * --overscan 读取原始文件时扣除过扫区电平并裁剪至有效区
+ * --trimsec 有效区. 缺省使用关键字TRIMSEC
+ * --biassec 过扫区. 缺省使用关键字BIASSEC
+ * --binning 叠加时估计偏移的降采样因子. 图像较大时自动增大, 使降采样后不超过1024
+ * --integer-shift 叠加时按整像素平移
+ * --minmax 叠加时采用min-max算法
+ * --cosmic 识别并修复宇宙线. L.A.Cosmic算法, 单次执行, 按分块并行
+ * --gain 增益
+ * --rdnoise 读出噪声
+ * --weight 输出权重图扩展
+ * --hugepage 数据缓存区使用大页内存
+ * --stats 输出数据缓存区池统计信息
+ * @note
+ * 模式4依据关键字IMAGETYP和曝光时间区分原文件目录下的本底/暗场/平场, 单次扫描后
+ * 按依赖关系调度合并. 暗场和平场须具有正曝光时间, 缺少IMAGETYP的零曝光图像视为本底
+ * @note
+ * --imgtyp/--exptime/--size作用于各模式扫描目录时的文件选择, 与-p同时生效
+ * @note
+ * 模式3未指定--roi时, 处理-i指定文件或目录下各文件, 以原文件名存至-o目录
+ * @note
+ * 模式5叠加原文件目录下的图像, 结果存储为结果目录(缺省为原文件目录)下的COADD.fit.
+ * 指定-z/--dark/--flat时, 各帧读取后先定标
+ * @note
+ * 分片合并(模式0/1/2)各分片仅通过文件系统协同:
+ * - 集群: 任一节点执行 -n N -P 生成计划, 各节点执行 -n N -k i, 任一节点执行
+ *   -n N -M 拼接. 未生成计划时各节点自行筛选文件
+ * - 本机: 执行 -n N, 生成计划并启动N个进程后拼接
+ * - 计划文件、局部文件和合并结果存储在-o目录, 缺省为原文件目录
  */
 int main(int argc, char **argv) {
 	// 解析命令行参数
+	ADIProcess adip;
+	int ch, mode(3), nshard(0), ishard(-1);
+	bool merge(false), plan(false), stats(false), useroi(false);
+	param_overscan overscan;
+	param_roi roi;
+	param_coadd coadd;
+	param_cosmic cosmic;
+	param_detector detector;
+	frame_filter filter;
+	size_t mem(0);
+	string pathname, prefix, output, zero, dark, flat;
+	struct option longopts[] = {
+		{ "mem", required_argument, NULL, 'G' },
+		{ "imgtyp", required_argument, NULL, 'J' },
+		{ "exptime", required_argument, NULL, 'L' },
+		{ "size", required_argument, NULL, 'Z' },
+		{ "screen", required_argument, NULL, 'S' },
+		{ "dark", required_argument, NULL, 'D' },
+		{ "flat", required_argument, NULL, 'F' },
+		{ "roi", required_argument, NULL, 'I' },
+		{ "roi-sky", required_argument, NULL, 'Y' },
+		{ "output", required_argument, NULL, 'O' },
+		{ "overscan", no_argument, NULL, 'V' },
+		{ "trimsec", required_argument, NULL, 'R' },
+		{ "biassec", required_argument, NULL, 'B' },
+		{ "binning", required_argument, NULL, 'N' },
+		{ "integer-shift", no_argument, NULL, 'A' },
+		{ "minmax", no_argument, NULL, 'C' },
+		{ "cosmic", no_argument, NULL, 'X' },
+		{ "gain", required_argument, NULL, 'E' },
+		{ "rdnoise", required_argument, NULL, 'W' },
+		{ "weight", no_argument, NULL, 'K' },
+		{ "hugepage", no_argument, NULL, 'H' },
+		{ "stats", no_argument, NULL, 'T' },
+		{ NULL, 0, NULL, 0 }
+	};
 
+	while ((ch = getopt_long(argc, argv, "m:i:p:o:z:n:k:MPh", longopts, NULL))
+			!= -1) {
+		switch (ch) {
+		case 'm':
+			mode = atoi(optarg);
+			break;
+		case 'i':
+			pathname = optarg;
+			break;
+		case 'p':
+			prefix = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'z':
+			zero = optarg;
+			break;
+		case 'n':
+			nshard = atoi(optarg);
+			break;
+		case 'k':
+			ishard = atoi(optarg);
+			break;
+		case 'M':
+			merge = true;
+			break;
+		case 'P':
+			plan = true;
+			break;
+		case 'G':
+			mem = parse_memory(optarg);
+			break;
+		case 'J':
+			filter.imgtyp = optarg;
+			break;
+		case 'L':
+		case 'Z':
+			if (!parse_filter(optarg, ch, filter)) {
+				print_help();
+				return -1;
+			}
+			break;
+		case 'S':
+			if (!parse_screen(optarg, adip)) {
+				print_help();
+				return -1;
+			}
+			break;
+		case 'D':
+			dark = optarg;
+			break;
+		case 'F':
+			flat = optarg;
+			break;
+		case 'I':
+		case 'Y':
+			if (!(useroi = parse_roi(optarg, ch == 'Y', roi))) {
+				print_help();
+				return -1;
+			}
+			break;
+		case 'O':
+			if (!strcasecmp(optarg, "int16"))
+				adip.SetOutputMode(OUTPUT_INT16);
+			else if (strcasecmp(optarg, "float")) {
+				print_help();
+				return -1;
+			}
+			break;
+		case 'V':
+			overscan.enable = true;
+			break;
+		case 'R':
+			overscan.enable = true;
+			overscan.trimsec = optarg;
+			break;
+		case 'B':
+			overscan.enable = true;
+			overscan.biassec = optarg;
+			break;
+		case 'N':
+			coadd.binning = atoi(optarg);
+			break;
+		case 'A':
+			coadd.bilinear = false;
+			break;
+		case 'C':
+			coadd.sigclip = false;
+			break;
+		case 'X':
+			cosmic.enable = true;
+			break;
+		case 'E':
+			detector.gain = atof(optarg);
+			break;
+		case 'W':
+			detector.readnoise = atof(optarg);
+			break;
+		case 'K':
+			adip.SetWeightMap(true);
+			break;
+		case 'H':
+			adip.SetHugePage(true);
+			break;
+		case 'T':
+			stats = true;
+			break;
+		default:
+			print_help();
+			return -1;
+		}
+	}
+	if (pathname.empty()) {
+		print_help();
+		return -1;
+	}
 
 	// 图像处理
-	// 输出处理结果
-
-	ADIProcess adip;
-	string pathname = "/Users/lxm/Data/processing";
-	string prefix = "Geo";
+	bool rslt(false);
 
-	adip.SetZero("/Users/lxm/Data/processing/ZERO.fit");
-	if (!adip.CombineFlat(pathname, prefix))
-		printf("failed\n");
-	else
-		printf("succeed\n");
+	filter.prefix = prefix;
+	adip.SetFilter(filter);
+	adip.SetMemoryBudget(mem);
+	adip.SetOverscan(overscan);
+	adip.SetCosmic(cosmic);
+	adip.SetDetector(detector);
+	if (!zero.empty() && !adip.SetZero(zero))
+		printf("failed to load ZERO: %s\n", zero.c_str());
+	if (!dark.empty() && !adip.SetDark(dark))
+		printf("failed to load DARK: %s\n", dark.c_str());
+	if (!flat.empty() && !adip.SetFlat(flat))
+		printf("failed to load FLAT: %s\n", flat.c_str());
+	try {
+		if (nshard > 0 && mode >= 0 && mode <= 2) {
+			string outdir = output.empty() ? pathname : output;
+			if (merge)
+				rslt = adip.MergeShard(mode, outdir, nshard, 3600);
+			else if (plan)
+				rslt = adip.PrepareShard(mode, pathname, prefix, outdir);
+			else if (ishard >= 0)
+				rslt = adip.CombineShard(mode, pathname, prefix, outdir,
+						ishard, nshard);
+			else
+				rslt = combine_shard_local(adip, mode, pathname, prefix,
+						outdir, mem, nshard);
+		} else if (mode == 0)
+			rslt = adip.CombineZero(pathname, prefix);
+		else if (mode == 1)
+			rslt = adip.CombineDark(pathname, prefix);
+		else if (mode == 2)
+			rslt = adip.CombineFlat(pathname, prefix);
+		else if (mode == 3 && useroi)
+			rslt = process_roi(adip, pathname, filter, roi);
+		else if (mode == 3)
+			rslt = process_image(adip, pathname, filter, output);
+		else if (mode == 4) {
+			param_calib param;
+			param.dir_zero = param.dir_dark = param.dir_flat = pathname;
+			param.dir_output = output;
+			rslt = adip.CombineAll(param);
+		} else if (mode == 5) {
+			path filepath = output.empty() ? pathname : output;
+			filepath /= "COADD.fit";
+			coadd.dir = pathname;
+			coadd.prefix = prefix;
+			coadd.output = filepath.string();
+			rslt = adip.Coadd(coadd);
+		}
+	}
+	catch(std::bad_alloc &) {// 超出内存预算
+		printf("memory budget exceeded\n");
+		rslt = false;
+	}
 
-//	string pathname = "/Volumes/NETAC/bias";
-//	string prefix = "bias_";
-//	if (!adip.CombineZero(pathname, prefix))
-//		cout << "failed" << endl;
-//	else
-//		cout << "success" << endl;
+	// 等待异步写入完成, 输出处理结果
+	vector<string> failed;
+	rslt = adip.Flush(&failed) && rslt;
+	for (vector<string>::iterator it = failed.begin(); it != failed.end(); ++it)
+		printf("%s: write failed\n", it->c_str());
+	printf("%s\n", rslt ? "succeed" : "failed");
+	if (stats) {
+		pool_stats ps = adip.PoolStats();
+		printf("buffer pool: %lu requests, %lu allocs, %lu reuses, peak %lu KB\n",
+				ps.requests, ps.allocs, ps.reuses, (unsigned long) (ps.peak >> 10));
+		quant_stats qs = adip.QuantStats();
+		printf("16-bit output: %lu frames, %lu kept float, max error/noise %.4f\n",
+				qs.nframe, qs.nfloat, qs.ratio_max);
+	}
 
-	return 0;
+	return rslt ? 0 : 1;
 }